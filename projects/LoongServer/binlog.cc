@@ -0,0 +1,352 @@
+#include "binlog.h"
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <chrono>
+
+namespace loongserver {
+  constexpr const char* BinLogFormat::MAGIC;
+
+  //bytes of records a thread can stage before it writes them itself
+  static const size_t s_binlog_ring_size = 1024 * 1024;
+  //writer thread poll period when no producer wakes it
+  static const uint32_t s_binlog_drain_ms = 10;
+
+  /**
+   * @brief records staged by one thread
+   * @details single producer byte ring, the owning thread appends whole
+   *          records and they are taken out under BinLogData::mutex only
+   */
+  struct BinLogRing {
+    using spBLR = std::shared_ptr<BinLogRing>;
+
+    BinLogRing(size_t size)
+      :buf(size)
+      ,mask(size - 1) {
+    }
+
+    /**
+     * @brief append one record, false if it does not fit
+     */
+    bool push(uint8_t tag, const char* body, size_t len) {
+      size_t need = 5 + len;
+      uint64_t t = tail.load(std::memory_order_relaxed);
+      if(buf.size() - (t - head.load(std::memory_order_acquire)) < need) {
+        return false;
+      }
+      char head5[5];
+      uint32_t len32 = len;
+      head5[0] = tag;
+      memcpy(head5 + 1, &len32, sizeof(len32));
+      copyIn(t, head5, sizeof(head5));
+      copyIn(t + sizeof(head5), body, len);
+      tail.store(t + need, std::memory_order_release);
+      return true;
+    }
+
+    /**
+     * @brief pass staged bytes to write in at most two pieces
+     * @return number of bytes taken out
+     */
+    template<class F>
+    size_t drain(F write) {
+      uint64_t h = head.load(std::memory_order_relaxed);
+      uint64_t t = tail.load(std::memory_order_acquire);
+      if(h == t) {
+        return 0;
+      }
+      size_t n = t - h;
+      size_t off = h & mask;
+      size_t first = std::min(n, buf.size() - off);
+      write(&buf[off], first);
+      if(n > first) {
+        write(&buf[0], n - first);
+      }
+      head.store(t, std::memory_order_release);
+      return n;
+    }
+
+    size_t used() const {
+      return tail.load(std::memory_order_relaxed) - head.load(std::memory_order_relaxed);
+    }
+
+    bool empty() const {
+      return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+    }
+
+  private:
+    void copyIn(uint64_t pos, const char* src, size_t n) {
+      size_t off = pos & mask;
+      size_t first = std::min(n, buf.size() - off);
+      memcpy(&buf[off], src, first);
+      memcpy(&buf[0], src + first, n - first);
+    }
+
+  public:
+    std::vector<char>     buf;
+    size_t                mask;
+    /// @brief owning thread exited
+    std::atomic<bool>     closed {false};
+    alignas(64) std::atomic<uint64_t> head {0};
+    alignas(64) std::atomic<uint64_t> tail {0};
+  };
+
+  struct BinLogData {
+    std::mutex                      mutex;
+    FILE*                           file {nullptr};
+    std::vector<BinLogSite*>        sites;
+    std::vector<BinLogRing::spBLR>  rings;
+    int                             crash_slot {-1};
+    /// @brief a file is open, producers stage nothing otherwise
+    std::atomic<bool>               open {false};
+    bool                            started {false};
+    std::atomic<bool>               sleeping {false};
+    std::mutex                      sleep_mutex;
+    std::condition_variable         sleep_cond;
+  };
+
+  //leaked, the writer thread keeps using it during static destruction
+  static BinLogData& GetBinLogData() {
+    static BinLogData* s_data = new BinLogData;
+    return *s_data;
+  }
+
+  struct BinLogRingHolder {
+    BinLogRing::spBLR ring;
+    ~BinLogRingHolder() {
+      if(ring) {
+        ring->closed = true;
+      }
+    }
+  };
+
+  static thread_local BinLogRingHolder t_binlogRing;
+
+  static BinLogRing* GetThreadRing(BinLogData& data) {
+    if(!t_binlogRing.ring) {
+      t_binlogRing.ring = std::make_shared<BinLogRing>(s_binlog_ring_size);
+      std::lock_guard<std::mutex> lock(data.mutex);
+      data.rings.push_back(t_binlogRing.ring);
+    }
+    return t_binlogRing.ring.get();
+  }
+
+  static void WriteRecordLocked(FILE* file, uint8_t tag, const char* body, size_t len) {
+    char head[5];
+    uint32_t len32 = len;
+    head[0] = tag;
+    memcpy(head + 1, &len32, sizeof(len32));
+    fwrite_unlocked(head, sizeof(head), 1, file);
+    fwrite_unlocked(body, len, 1, file);
+  }
+
+  /**
+   * @brief move staged records of all threads to the file
+   * @return number of bytes moved
+   */
+  static size_t DrainLocked(BinLogData& data) {
+    size_t total = 0;
+    bool has_closed = false;
+    for(auto& i : data.rings) {
+      total += i->drain([&data](const char* p, size_t n) {
+        if(data.file) {
+          fwrite_unlocked(p, n, 1, data.file);
+        }
+      });
+      has_closed = has_closed || i->closed;
+    }
+    if(has_closed) {
+      for(auto it = data.rings.begin(); it != data.rings.end();) {
+        if((*it)->closed && (*it)->empty()) {
+          it = data.rings.erase(it);
+        }else {
+          ++it;
+        }
+      }
+    }
+    return total;
+  }
+
+  static void AppendString16(std::string& out, const char* str, size_t len) {
+    uint16_t len16 = std::min<size_t>(len, UINT16_MAX);
+    out.append(reinterpret_cast<const char*>(&len16), sizeof(len16));
+    out.append(str, len16);
+  }
+
+  static void WriteSiteLocked(FILE* file, const BinLogSite& site, uint32_t id) {
+    std::string body;
+    uint8_t level = site.m_level;
+    body.append(reinterpret_cast<const char*>(&id), sizeof(id));
+    body.append(reinterpret_cast<const char*>(&level), sizeof(level));
+    body.append(reinterpret_cast<const char*>(&site.m_line), sizeof(site.m_line));
+    AppendString16(body, site.m_file, strlen(site.m_file));
+    AppendString16(body, site.m_fmt, strlen(site.m_fmt));
+    AppendString16(body, site.m_logger.data(), site.m_logger.size());
+    body.append(1, (char)site.m_args.size());
+    body.append(site.m_args.begin(), site.m_args.end());
+    WriteRecordLocked(file, BinLogFormat::SITE, body.data(), body.size());
+  }
+
+  /**
+   * @brief writer thread, moves staged records to the file
+   */
+  static void BinLogWriterMain() {
+    Thread::SetName("binlog");
+    BinLogData& data = GetBinLogData();
+    while(true) {
+      size_t n;
+      {
+        std::lock_guard<std::mutex> lock(data.mutex);
+        n = DrainLocked(data);
+      }
+      if(n) {
+        continue;
+      }
+      //producers only notify while we sleep, the timeout covers a missed wakeup
+      std::unique_lock<std::mutex> lock(data.sleep_mutex);
+      data.sleeping = true;
+      data.sleep_cond.wait_for(lock, std::chrono::milliseconds(s_binlog_drain_ms));
+      data.sleeping = false;
+    }
+  }
+
+  static void FlushBinLogAtExit() {
+    BinLog::Flush();
+  }
+
+  static void CrashWriteFd(int fd, const char* p, size_t n) {
+    while(n) {
+      ssize_t rt = ::write(fd, p, n);
+      if(rt < 0 && errno == EINTR) {
+        continue;
+      }
+      if(rt <= 0) {
+        return;
+      }
+      p += rt;
+      n -= rt;
+    }
+  }
+
+  /**
+   * @brief LogCrash callback, writes what the stdio buffer and the rings still hold
+   */
+  static int BinLogEmergencyFlush(void* arg) {
+    BinLogData& data = *static_cast<BinLogData*>(arg);
+    //a holder may be in the middle of a record, never unlocked afterwards
+    if(data.mutex.try_lock() && data.file) {
+      LogCrash::DrainFile(data.file);
+      int fd = fileno(data.file);
+      for(auto& i : data.rings) {
+        i->drain([fd](const char* p, size_t n) {
+          CrashWriteFd(fd, p, n);
+        });
+      }
+    }
+    return -1;
+  }
+
+  bool BinLog::Open(const std::string& filename) {
+    BinLogData& data = GetBinLogData();
+    std::lock_guard<std::mutex> lock(data.mutex);
+    if(data.crash_slot < 0) {
+      data.crash_slot = LogCrash::Register(&BinLogEmergencyFlush, &data);
+    }
+    if(!data.started) {
+      data.started = true;
+      std::thread(&BinLogWriterMain).detach();
+      atexit(FlushBinLogAtExit);
+    }
+    if(data.file) {
+      DrainLocked(data);
+      fclose(data.file);
+    }
+    data.file = fopen(filename.c_str(), "ab");
+    if(!data.file) {
+      data.open = false;
+      std::cout << "BinLog open " << filename << " failed" << std::endl;
+      return false;
+    }
+    setvbuf(data.file, nullptr, _IOFBF, 1024 * 1024);
+
+    fseek(data.file, 0, SEEK_END);
+    if(ftell(data.file) == 0) {
+      fwrite_unlocked(BinLogFormat::MAGIC, BinLogFormat::MAGIC_SIZE, 1, data.file);
+    }
+    //a new file has to describe every site before its events
+    for(size_t i = 0; i < data.sites.size(); ++i) {
+      WriteSiteLocked(data.file, *data.sites[i], i + 1);
+    }
+    data.open = true;
+    return true;
+  }
+
+  void BinLog::Close() {
+    BinLogData& data = GetBinLogData();
+    std::lock_guard<std::mutex> lock(data.mutex);
+    data.open = false;
+    if(data.file) {
+      DrainLocked(data);
+      fclose(data.file);
+      data.file = nullptr;
+    }
+  }
+
+  void BinLog::Flush() {
+    BinLogData& data = GetBinLogData();
+    std::lock_guard<std::mutex> lock(data.mutex);
+    if(data.file) {
+      DrainLocked(data);
+      fflush_unlocked(data.file);
+    }
+  }
+
+  uint32_t BinLog::RegisterSite(BinLogSite& site, const std::string& logger
+                                ,const uint8_t* types, size_t count) {
+    BinLogData& data = GetBinLogData();
+    std::lock_guard<std::mutex> lock(data.mutex);
+    uint32_t id = site.m_id.load(std::memory_order_relaxed);
+    if(id) {
+      return id;
+    }
+
+    site.m_logger = logger;
+    site.m_args.assign(types, types + count);
+    data.sites.push_back(&site);
+    id = data.sites.size();
+    //written at once, so it is in the file before any event staged for it
+    if(data.file) {
+      WriteSiteLocked(data.file, site, id);
+    }
+    site.m_id.store(id, std::memory_order_release);
+    return id;
+  }
+
+  void BinLog::WriteRecord(uint8_t tag, const char* body, size_t len) {
+    BinLogData& data = GetBinLogData();
+    if(!data.open.load(std::memory_order_relaxed)) {
+      return;
+    }
+    BinLogRing* ring = GetThreadRing(data);
+    if(ring->push(tag, body, len)) {
+      if(ring->used() > s_binlog_ring_size / 2
+          && data.sleeping.load(std::memory_order_relaxed)) {
+        data.sleep_cond.notify_one();
+      }
+      return;
+    }
+
+    //ring full or record larger than it: write it behind what is staged
+    std::lock_guard<std::mutex> lock(data.mutex);
+    DrainLocked(data);
+    if(data.file) {
+      WriteRecordLocked(data.file, tag, body, len);
+    }
+  }
+
+  LogStream& BinLog::GetBuffer() {
+    static thread_local LogStream t_buffer;
+    return t_buffer;
+  }
+}
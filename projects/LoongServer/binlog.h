@@ -0,0 +1,237 @@
+#ifndef __LOONGSERVER_BINLOG_H__
+#define __LOONGSERVER_BINLOG_H__
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <type_traits>
+#include <stdio.h>
+
+#include "log.h"
+
+/**
+ * @brief put log into the binary log stream, formatting is deferred to
+ *        loongserver-logdecode
+ * @details fmt must be a string literal, arguments are stored raw:
+ *          integers, floating point, pointers, C strings and std::string
+ */
+#define LOONGSERVER_LOG_BIN_LEVEL(logger, level, fmt, ...) \
+  do { \
+    if((level) >= LOONGSERVER_LOG_MIN_LEVEL && logger->isEnabled(level)) { \
+      static loongserver::BinLogSite __loongserver_bin_site(level, __FILE__, __LINE__, fmt); \
+      loongserver::BinLog::Write(__loongserver_bin_site, logger, ##__VA_ARGS__); \
+    } \
+  } while(0)
+
+#define LOONGSERVER_LOG_BIN_DEBUG(logger, fmt, ...) LOONGSERVER_LOG_BIN_LEVEL(logger, loongserver::LogLevel::DEBUG, fmt, ##__VA_ARGS__)
+#define LOONGSERVER_LOG_BIN_INFO(logger, fmt, ...) LOONGSERVER_LOG_BIN_LEVEL(logger, loongserver::LogLevel::INFO, fmt, ##__VA_ARGS__)
+#define LOONGSERVER_LOG_BIN_WARN(logger, fmt, ...) LOONGSERVER_LOG_BIN_LEVEL(logger, loongserver::LogLevel::WARN, fmt, ##__VA_ARGS__)
+#define LOONGSERVER_LOG_BIN_ERROR(logger, fmt, ...) LOONGSERVER_LOG_BIN_LEVEL(logger, loongserver::LogLevel::ERROR, fmt, ##__VA_ARGS__)
+#define LOONGSERVER_LOG_BIN_FATAL(logger, fmt, ...) LOONGSERVER_LOG_BIN_LEVEL(logger, loongserver::LogLevel::FATAL, fmt, ##__VA_ARGS__)
+
+namespace loongserver {
+
+/**
+ * @brief layout of the binary log stream
+ * @details the stream starts with MAGIC, then records of
+ *          [u8 tag][u32 body length][body], integers in host byte order.
+ *          SITE body: u32 id, u8 level, i32 line, then file, fmt and logger
+ *          name as u16 length + bytes, then u8 count + one type per argument.
+ *          EVENT body: u32 site id, u64 time in us, u64 elapse in ns,
+ *          u32 thread id, u32 fiber id, then the arguments in site order.
+ *          Streams of version 1 (LSBINLOG1) have no elapse.
+ */
+class BinLogFormat {
+public:
+  static constexpr const char* MAGIC = "LSBINLOG2\n";
+  static const size_t MAGIC_SIZE = 10;
+
+  enum Tag {
+    SITE = 'S',
+    EVENT = 'E',
+  };
+
+  enum ArgType {
+    /** int64 */
+    INT = 1,
+    /** uint64 */
+    UINT = 2,
+    /** double */
+    DOUBLE = 3,
+    /** u32 length + bytes */
+    STRING = 4,
+    /** uint64 */
+    POINTER = 5,
+  };
+};
+
+/**
+ * @brief static description of a binary log call site
+ * @details registered with BinLog on its first use, its id is what events
+ *          carry instead of file, line, format and logger name
+ */
+class BinLogSite : Noncopyable {
+public:
+  BinLogSite(LogLevel::Level level, const char* file, int32_t line, const char* fmt)
+    :m_level(level)
+    ,m_file(file)
+    ,m_line(line)
+    ,m_fmt(fmt) {
+  }
+
+  LogLevel::Level       m_level;
+  const char*           m_file;
+  int32_t               m_line;
+  const char*           m_fmt;
+  std::string           m_logger;
+  std::vector<uint8_t>  m_args;
+  std::atomic<uint32_t> m_id {0};
+};
+
+template<class T, class Enable = void>
+struct BinLogArg;
+
+template<class T>
+struct BinLogArg<T, typename std::enable_if<std::is_integral<T>::value && std::is_signed<T>::value>::type> {
+  static const uint8_t TYPE = BinLogFormat::INT;
+  static void Encode(LogStream& buf, T v) {
+    int64_t x = v;
+    buf.append(reinterpret_cast<const char*>(&x), sizeof(x));
+  }
+};
+
+template<class T>
+struct BinLogArg<T, typename std::enable_if<std::is_integral<T>::value && std::is_unsigned<T>::value>::type> {
+  static const uint8_t TYPE = BinLogFormat::UINT;
+  static void Encode(LogStream& buf, T v) {
+    uint64_t x = v;
+    buf.append(reinterpret_cast<const char*>(&x), sizeof(x));
+  }
+};
+
+template<class T>
+struct BinLogArg<T, typename std::enable_if<std::is_enum<T>::value>::type> {
+  static const uint8_t TYPE = BinLogFormat::INT;
+  static void Encode(LogStream& buf, T v) {
+    int64_t x = static_cast<int64_t>(v);
+    buf.append(reinterpret_cast<const char*>(&x), sizeof(x));
+  }
+};
+
+template<class T>
+struct BinLogArg<T, typename std::enable_if<std::is_floating_point<T>::value>::type> {
+  static const uint8_t TYPE = BinLogFormat::DOUBLE;
+  static void Encode(LogStream& buf, T v) {
+    double x = v;
+    buf.append(reinterpret_cast<const char*>(&x), sizeof(x));
+  }
+};
+
+template<class T>
+struct BinLogArg<T*, typename std::enable_if<!std::is_same<typename std::remove_cv<T>::type, char>::value>::type> {
+  static const uint8_t TYPE = BinLogFormat::POINTER;
+  static void Encode(LogStream& buf, T* v) {
+    uint64_t x = reinterpret_cast<uintptr_t>(v);
+    buf.append(reinterpret_cast<const char*>(&x), sizeof(x));
+  }
+};
+
+template<class T>
+struct BinLogArg<T*, typename std::enable_if<std::is_same<typename std::remove_cv<T>::type, char>::value>::type> {
+  static const uint8_t TYPE = BinLogFormat::STRING;
+  static void Encode(LogStream& buf, const char* v) {
+    if(!v) {
+      v = "(null)";
+    }
+    uint32_t len = strlen(v);
+    buf.append(reinterpret_cast<const char*>(&len), sizeof(len));
+    buf.append(v, len);
+  }
+};
+
+template<>
+struct BinLogArg<std::string> {
+  static const uint8_t TYPE = BinLogFormat::STRING;
+  static void Encode(LogStream& buf, const std::string& v) {
+    uint32_t len = v.size();
+    buf.append(reinterpret_cast<const char*>(&len), sizeof(len));
+    buf.append(v.data(), len);
+  }
+};
+
+/**
+ * @brief writer of the binary log stream
+ * @details events are staged in a ring of the calling thread and moved to
+ *          the file by a background thread, a thread whose ring is full
+ *          writes its record itself after moving what is staged
+ */
+class BinLog {
+public:
+  /**
+   * @brief start writing to filename, appends if it already exists
+   * @return success -> true
+   */
+  static bool Open(const std::string& filename);
+  /**
+   * @brief flush and close the stream
+   */
+  static void Close();
+  /**
+   * @brief move staged records to the file and flush it
+   */
+  static void Flush();
+
+  /**
+   * @brief record one event of site
+   */
+  template<class... Args>
+  static void Write(BinLogSite& site, const std::shared_ptr<Logger>& logger, const Args&... args) {
+    uint32_t id = site.m_id.load(std::memory_order_acquire);
+    if(!id) {
+      const uint8_t types[] = {BinLogArg<typename std::decay<Args>::type>::TYPE..., 0};
+      id = RegisterSite(site, logger->getName(), types, sizeof...(Args));
+    }
+
+    LogStream& buf = GetBuffer();
+    buf.clear();
+    uint64_t time = GetCoarseCurrentUS();
+    uint64_t elapse = GetMonotonicNS();
+    uint32_t thread_id = GetThreadId();
+    uint32_t fiber_id = GetFiberId();
+    buf.append(reinterpret_cast<const char*>(&id), sizeof(id));
+    buf.append(reinterpret_cast<const char*>(&time), sizeof(time));
+    buf.append(reinterpret_cast<const char*>(&elapse), sizeof(elapse));
+    buf.append(reinterpret_cast<const char*>(&thread_id), sizeof(thread_id));
+    buf.append(reinterpret_cast<const char*>(&fiber_id), sizeof(fiber_id));
+    EncodeArgs(buf, args...);
+    WriteRecord(BinLogFormat::EVENT, buf.data(), buf.size());
+  }
+
+private:
+  static void EncodeArgs(LogStream&) {}
+
+  template<class T, class... Args>
+  static void EncodeArgs(LogStream& buf, const T& v, const Args&... args) {
+    BinLogArg<typename std::decay<T>::type>::Encode(buf, v);
+    EncodeArgs(buf, args...);
+  }
+
+  /**
+   * @brief assign id to site and write its description
+   */
+  static uint32_t RegisterSite(BinLogSite& site, const std::string& logger
+                               ,const uint8_t* types, size_t count);
+  /**
+   * @brief stage one record for the stream
+   */
+  static void WriteRecord(uint8_t tag, const char* body, size_t len);
+  /**
+   * @brief return encode buffer of the calling thread
+   */
+  static LogStream& GetBuffer();
+};
+
+}
+
+#endif
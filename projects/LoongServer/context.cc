@@ -0,0 +1,160 @@
+#include "context.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if LOONGSERVER_CONTEXT_ASM
+/**
+ * @brief save callee-saved registers on the current stack, store the stack
+ *        pointer into *from, switch to to and restore what it saved
+ */
+extern "C" void loongserver_swap_context(void** from, void* to);
+/**
+ * @brief first return address of a new context, calls the entry kept in a
+ *        callee-saved register
+ */
+extern "C" void loongserver_context_entry();
+
+#if defined(__x86_64__)
+/**
+ * frame, from the saved stack pointer up:
+ * mxcsr(4) x87 cw(4) r15 r14 r13 r12 rbx rbp return address
+ */
+asm(R"(
+  .text
+  .globl loongserver_swap_context
+  .type loongserver_swap_context,@function
+  .align 16
+loongserver_swap_context:
+  pushq %rbp
+  pushq %rbx
+  pushq %r12
+  pushq %r13
+  pushq %r14
+  pushq %r15
+  subq $8, %rsp
+  stmxcsr (%rsp)
+  fnstcw 4(%rsp)
+  movq %rsp, (%rdi)
+  movq %rsi, %rsp
+  ldmxcsr (%rsp)
+  fldcw 4(%rsp)
+  addq $8, %rsp
+  popq %r15
+  popq %r14
+  popq %r13
+  popq %r12
+  popq %rbx
+  popq %rbp
+  ret
+  .size loongserver_swap_context,.-loongserver_swap_context
+
+  .globl loongserver_context_entry
+  .type loongserver_context_entry,@function
+  .align 16
+loongserver_context_entry:
+  callq *%r12
+  ud2
+  .size loongserver_context_entry,.-loongserver_context_entry
+)");
+
+namespace {
+  const size_t CONTEXT_FRAME_WORDS = 8;
+  const size_t CONTEXT_ENTRY_SLOT = 4;
+  const size_t CONTEXT_RETURN_SLOT = 7;
+  //default mxcsr and x87 control word, as the abi starts a thread with
+  const uint64_t CONTEXT_FPU_STATE = 0x1f80ull | (0x037full << 32);
+}
+#elif defined(__aarch64__)
+/**
+ * frame, from the saved stack pointer up:
+ * x19-x28 x29 x30 d8-d15
+ */
+asm(R"(
+  .text
+  .globl loongserver_swap_context
+  .type loongserver_swap_context,%function
+  .align 4
+loongserver_swap_context:
+  sub sp, sp, #160
+  stp x19, x20, [sp, #0]
+  stp x21, x22, [sp, #16]
+  stp x23, x24, [sp, #32]
+  stp x25, x26, [sp, #48]
+  stp x27, x28, [sp, #64]
+  stp x29, x30, [sp, #80]
+  stp d8, d9, [sp, #96]
+  stp d10, d11, [sp, #112]
+  stp d12, d13, [sp, #128]
+  stp d14, d15, [sp, #144]
+  mov x9, sp
+  str x9, [x0]
+  mov sp, x1
+  ldp x19, x20, [sp, #0]
+  ldp x21, x22, [sp, #16]
+  ldp x23, x24, [sp, #32]
+  ldp x25, x26, [sp, #48]
+  ldp x27, x28, [sp, #64]
+  ldp x29, x30, [sp, #80]
+  ldp d8, d9, [sp, #96]
+  ldp d10, d11, [sp, #112]
+  ldp d12, d13, [sp, #128]
+  ldp d14, d15, [sp, #144]
+  add sp, sp, #160
+  ret
+  .size loongserver_swap_context,.-loongserver_swap_context
+
+  .globl loongserver_context_entry
+  .type loongserver_context_entry,%function
+  .align 4
+loongserver_context_entry:
+  blr x19
+  brk #0
+  .size loongserver_context_entry,.-loongserver_context_entry
+)");
+
+namespace {
+  const size_t CONTEXT_FRAME_WORDS = 20;
+  const size_t CONTEXT_ENTRY_SLOT = 0;
+  const size_t CONTEXT_RETURN_SLOT = 11;
+}
+#endif
+#endif
+
+namespace loongserver {
+#if LOONGSERVER_CONTEXT_ASM
+  void Context::make(void* stack, size_t size, Entry entry) {
+    //the entry runs with the stack aligned as after a call
+    uintptr_t top = (reinterpret_cast<uintptr_t>(stack) + size) & ~(uintptr_t)15;
+    uint64_t* frame = reinterpret_cast<uint64_t*>(top) - CONTEXT_FRAME_WORDS;
+    memset(frame, 0, CONTEXT_FRAME_WORDS * sizeof(uint64_t));
+#if defined(__x86_64__)
+    frame[0] = CONTEXT_FPU_STATE;
+#endif
+    frame[CONTEXT_ENTRY_SLOT] = reinterpret_cast<uint64_t>(entry);
+    frame[CONTEXT_RETURN_SLOT] = reinterpret_cast<uint64_t>(&loongserver_context_entry);
+    m_sp = frame;
+  }
+
+  void Context::Swap(Context& from, Context& to) {
+    loongserver_swap_context(&from.m_sp, to.m_sp);
+  }
+#else
+  void Context::make(void* stack, size_t size, Entry entry) {
+    if(getcontext(&m_ctx)) {
+      abort();
+    }
+    m_ctx.uc_link = nullptr;
+    m_ctx.uc_stack.ss_sp = stack;
+    m_ctx.uc_stack.ss_size = size;
+    makecontext(&m_ctx, entry, 0);
+  }
+
+  void Context::Swap(Context& from, Context& to) {
+    if(swapcontext(&from.m_ctx, &to.m_ctx)) {
+      abort();
+    }
+  }
+#endif
+}
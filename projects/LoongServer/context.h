@@ -0,0 +1,50 @@
+#ifndef __LOONGSERVER_CONTEXT_H__
+#define __LOONGSERVER_CONTEXT_H__
+
+#include <stddef.h>
+
+/**
+ * @brief LOONGSERVER_FIBER_ASM (CMakeLists.txt) picks the hand written switch
+ *        on x86-64 and aarch64, any other build uses ucontext
+ */
+#if defined(LOONGSERVER_FIBER_ASM) && LOONGSERVER_FIBER_ASM \
+    && (defined(__x86_64__) || defined(__aarch64__))
+#define LOONGSERVER_CONTEXT_ASM 1
+#else
+#define LOONGSERVER_CONTEXT_ASM 0
+#include <ucontext.h>
+#endif
+
+namespace loongserver {
+  /**
+   * @brief saved execution state of a fiber
+   * @details the assembly switch saves the callee-saved registers on the
+   *          stack being left and keeps only the stack pointer, no signal
+   *          mask syscall as in swapcontext
+   */
+  class Context {
+  public:
+    using Entry = void (*)();
+
+    /**
+     * @brief prepare to run entry on [stack, stack + size) at the next Swap
+     * @attention entry must never return
+     */
+    void make(void* stack, size_t size, Entry entry);
+
+    /**
+     * @brief save the running state into from and resume to
+     */
+    static void Swap(Context& from, Context& to);
+
+  private:
+#if LOONGSERVER_CONTEXT_ASM
+    /// @brief stack pointer of the suspended context
+    void* m_sp = nullptr;
+#else
+    ucontext_t m_ctx;
+#endif
+  };
+}
+
+#endif
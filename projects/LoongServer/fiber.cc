@@ -1,8 +1,18 @@
 #include "fiber.h"
+#include "scheduler.h"
 #include "config.h"
 #include "log.h"
+#include "macro.h"
 
 #include <atomic>
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <new>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 namespace loongserver{
 
@@ -14,8 +24,14 @@ namespace loongserver{
   static thread_local Fiber* t_fiber = nullptr;
   static thread_local Fiber::spFIBER t_threadFiber = nullptr;
 
+  //fiber scheduled fibers come back to, the thread main fiber outside a scheduler
+  static Fiber* GetReturnFiber() {
+    Fiber* f = Scheduler::GetMainFiber();
+    return f ? f : t_threadFiber.get();
+  }
+
   static ConfigVar<uint32_t>::spCV g_fiber_stack_size = 
-    Config::Lookup<uin32_t>("fiber.stack_size", 128 * 1024, "fiber stack size");
+    Config::Lookup<uint32_t>("fiber.stack_size", 128 * 1024, "fiber stack size");
 
   class MallocStackAllocator {
     public:
@@ -28,7 +44,222 @@ namespace loongserver{
       }
   };
 
+  static ConfigVar<uint32_t>::spCV g_fiber_stack_pool_warm = 
+    Config::Lookup<uint32_t>("fiber.stack_pool_warm", 16, "recycled fiber stacks kept resident per thread");
+
+  static ConfigVar<uint32_t>::spCV g_fiber_stack_pool_max = 
+    Config::Lookup<uint32_t>("fiber.stack_pool_max", 256, "recycled fiber stacks kept per thread");
+
+  //fibers destroyed after the pool during thread exit unmap directly
+  static thread_local bool t_stackPoolGone = false;
+  static const size_t s_page_size = sysconf(_SC_PAGESIZE);
+
+  /**
+   * @brief recycled stacks of one thread
+   * @details warm stacks are handed out first, stacks freed above the warm
+   *          watermark give their pages back with MADV_DONTNEED and keep only
+   *          the mapping
+   */
+  struct StackPool {
+    struct Stack {
+      void*   base;
+      size_t  size;
+    };
+
+    std::vector<Stack> warm;
+    std::vector<Stack> cold;
+
+    ~StackPool() {
+      t_stackPoolGone = true;
+      for(auto& i : warm) {
+        munmap(i.base, i.size);
+      }
+      for(auto& i : cold) {
+        munmap(i.base, i.size);
+      }
+    }
+
+    static bool Take(std::vector<Stack>& list, size_t size, void*& base) {
+      for(size_t i = list.size(); i > 0; --i) {
+        if(list[i - 1].size == size) {
+          base = list[i - 1].base;
+          list.erase(list.begin() + i - 1);
+          return true;
+        }
+      }
+      return false;
+    }
+  };
+
+  static thread_local StackPool t_stackPool;
+
+  /**
+   * @brief mmap stacks with a PROT_NONE guard page below them, so an
+   *        overflow faults at once instead of corrupting the heap
+   */
+  class MmapStackAllocator {
+    public:
+      static void* Alloc(size_t size) {
+        size_t total = RoundUp(size) + s_page_size;
+        void* base = nullptr;
+        if(t_stackPoolGone
+            || (!StackPool::Take(t_stackPool.warm, total, base)
+                && !StackPool::Take(t_stackPool.cold, total, base))) {
+          base = mmap(nullptr, total, PROT_READ | PROT_WRITE
+                      ,MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+          if(base == MAP_FAILED) {
+            LOONGSERVER_LOG_ERROR(g_logger) << "MmapStackAllocator mmap size=" << total
+                << " failed: " << strerror(errno);
+            throw std::bad_alloc();
+          }
+          if(mprotect(base, s_page_size, PROT_NONE)) {
+            LOONGSERVER_LOG_ERROR(g_logger) << "MmapStackAllocator guard page failed: " << strerror(errno);
+          }
+        }
+        return static_cast<char*>(base) + s_page_size;
+      }
+
+      static void Dealloc(void* vp, size_t size) {
+        StackPool::Stack stack;
+        stack.base = static_cast<char*>(vp) - s_page_size;
+        stack.size = RoundUp(size) + s_page_size;
+
+        if(t_stackPoolGone) {
+          munmap(stack.base, stack.size);
+          return;
+        }
+        StackPool& pool = t_stackPool;
+        if(pool.warm.size() < g_fiber_stack_pool_warm->getValue()) {
+          pool.warm.push_back(stack);
+          return;
+        }
+        if(pool.warm.size() + pool.cold.size() < g_fiber_stack_pool_max->getValue()) {
+          madvise(vp, stack.size - s_page_size, MADV_DONTNEED);
+          pool.cold.push_back(stack);
+          return;
+        }
+        munmap(stack.base, stack.size);
+      }
+
+    private:
+      static size_t RoundUp(size_t size) {
+        return (size + s_page_size - 1) / s_page_size * s_page_size;
+      }
+  };
+
+#if LOONGSERVER_FIBER_MMAP_STACK
+  using StackAllocator = MmapStackAllocator;
+#else
   using StackAllocator = MallocStackAllocator;
+#endif
+
+  static ConfigVar<uint32_t>::spCV g_fiber_shared_stack_size = 
+    Config::Lookup<uint32_t>("fiber.shared_stack_size", 1024 * 1024, "size of a shared fiber stack");
+
+  static ConfigVar<uint32_t>::spCV g_fiber_shared_stack_count = 
+    Config::Lookup<uint32_t>("fiber.shared_stack_count", 4, "shared fiber stacks per thread");
+
+  //below the recorded stack position: the context switch frames and the red zone
+  static const size_t s_shared_stack_margin = 1024;
+
+  /**
+   * @brief stack shared by several fibers of one thread
+   * @details one fiber occupies it at a time, when another one comes in the
+   *          occupant's used part is copied to its save buffer and the
+   *          newcomer's saved part is copied back
+   */
+  struct SharedStack : Noncopyable {
+    using spSS = std::shared_ptr<SharedStack>;
+
+    SharedStack(size_t size)
+      :size(size) {
+      stack = static_cast<char*>(StackAllocator::Alloc(size));
+    }
+
+    ~SharedStack() {
+      StackAllocator::Dealloc(stack, size);
+    }
+
+    /**
+     * @brief return a shared stack of the calling thread, round robin
+     */
+    static spSS Acquire();
+
+    /**
+     * @brief make the stack ready to resume f, called off this stack
+     */
+    void enter(Fiber* f) {
+      if(occupant != f) {
+        if(occupant && occupant->m_state != Fiber::INIT
+            && occupant->m_state != Fiber::TERM
+            && occupant->m_state != Fiber::EXCEPT) {
+          save(occupant);
+        }
+        occupant = f;
+        if(f->m_state != Fiber::INIT) {
+          memcpy(top() - f->m_savedSize, f->m_saved, f->m_savedSize);
+        }
+      }
+      if(f->m_state == Fiber::INIT) {
+        f->m_ctx.make(stack, size, &Fiber::MainFunc);
+      }
+    }
+
+    /**
+     * @brief remember how deep f uses the stack, called on this stack
+     */
+    void leave(Fiber* f) {
+      char marker;
+      f->m_stackLow = std::max(&marker - s_shared_stack_margin, stack);
+    }
+
+    /**
+     * @brief forget f, it will not run again
+     */
+    void release(Fiber* f) {
+      if(occupant == f) {
+        occupant = nullptr;
+      }
+    }
+
+    char* top() const { return stack + size; }
+
+  private:
+    void save(Fiber* f) {
+      size_t used = top() - f->m_stackLow;
+      //right-sized: grow as needed, give memory back after a deep call
+      if(f->m_savedCap < used || f->m_savedCap > used * 2) {
+        char* saved = static_cast<char*>(malloc(used));
+        if(!saved) {
+          //occupant is unchanged, its frames are still on the stack
+          LOONGSERVER_LOG_ERROR(g_logger) << "SharedStack save size=" << used
+              << " failed: " << strerror(errno);
+          throw std::bad_alloc();
+        }
+        free(f->m_saved);
+        f->m_saved = saved;
+        f->m_savedCap = used;
+      }
+      memcpy(f->m_saved, f->m_stackLow, used);
+      f->m_savedSize = used;
+    }
+
+  public:
+    char*   stack = nullptr;
+    size_t  size = 0;
+    Fiber*  occupant = nullptr;
+  };
+
+  static thread_local std::vector<SharedStack::spSS> t_sharedStacks;
+  static thread_local size_t t_sharedStackNext = 0;
+
+  SharedStack::spSS SharedStack::Acquire() {
+    if(t_sharedStacks.size() < std::max<uint32_t>(g_fiber_shared_stack_count->getValue(), 1)) {
+      t_sharedStacks.push_back(std::make_shared<SharedStack>(g_fiber_shared_stack_size->getValue()));
+      return t_sharedStacks.back();
+    }
+    return t_sharedStacks[t_sharedStackNext++ % t_sharedStacks.size()];
+  }
 
   uint64_t Fiber::GetFiberId() {
     if(t_fiber){
@@ -41,37 +272,277 @@ namespace loongserver{
     m_state = EXEC;
     SetThis(this);
 
-    if(getcontext(&m_ctx)) {
-      LOONGSERVER_ASSERT2(false, "getcontext");
-    }
-
     ++s_fiber_count;
 
     LOONGSERVER_LOG_DEBUG(g_logger) << "Fiber::Fiber main";
   }
 
-  Fiber::Fiber(std::function<void()> cb, size_t stacksize, bool use_caller)
+  Fiber::Fiber(std::function<void()> cb, size_t stacksize, bool use_caller, bool shared_stack)
     :m_id(++s_fiber_id)
     ,m_cb(cb) {
       ++s_fiber_count;
+      if(shared_stack) {
+        //the context is made on the shared stack when the fiber first runs
+        LOONGSERVER_ASSERT2(!use_caller, "shared stack fiber can not be use_caller");
+        m_sharedStack = SharedStack::Acquire();
+        m_stackThread = GetThreadId();
+        LOONGSERVER_LOG_DEBUG(g_logger) << "Fiber::Fiber id=" << m_id << " shared stack";
+        return;
+      }
       m_stacksize = stacksize? stacksize : g_fiber_stack_size->getValue();
 
       m_stack = StackAllocator::Alloc(m_stacksize);
-      if(getcontext(&m_ctx)) {
-        LOONGSERVER_ASSERT2(false, "getcontext");
-      }
-      m_ctx.uc_link = nullptr;
-      m_ctx.uc_stack.ss_sp = m_stack;
-      m_ctx.uc_stack.ss_size = m_stacksize;
-
       if(!use_caller) {
-        makecontext(&m_ctx, &Fiber::MainFunc, 0);
+        m_ctx.make(m_stack, m_stacksize, &Fiber::MainFunc);
       }else {
-        makecontext(&m_ctx, &Fiber::CallerMainFunc, 0);
+        m_ctx.make(m_stack, m_stacksize, &Fiber::CallerMainFunc);
       }
 
       LOONGSERVER_LOG_DEBUG(g_logger) << "Fiber::Fiber id=" << m_id;
     }
 
+  Fiber::~Fiber() {
+    --s_fiber_count;
+    if(m_sharedStack) {
+      LOONGSERVER_ASSERT(m_state == TERM
+              || m_state == EXCEPT
+              || m_state == INIT);
 
+      m_sharedStack->release(this);
+      free(m_saved);
+    }else if(m_stack) {
+      LOONGSERVER_ASSERT(m_state == TERM
+              || m_state == EXCEPT
+              || m_state == INIT);
+
+      StackAllocator::Dealloc(m_stack, m_stacksize);
+    }else {
+      //main fiber of a thread
+      LOONGSERVER_ASSERT(!m_cb);
+      LOONGSERVER_ASSERT(m_state == EXEC);
+
+      if(t_fiber == this) {
+        SetThis(nullptr);
+      }
+    }
+    LOONGSERVER_LOG_DEBUG(g_logger) << "Fiber::~Fiber id=" << m_id
+                                    << " total=" << s_fiber_count;
+  }
+
+  void Fiber::reset(std::function<void()> cb) {
+    LOONGSERVER_ASSERT(m_stack || m_sharedStack);
+    LOONGSERVER_ASSERT(m_state == TERM
+            || m_state == EXCEPT
+            || m_state == INIT);
+    m_cb = cb;
+    if(m_sharedStack) {
+      //made by SharedStack::enter, the stack may belong to another fiber now
+      m_savedSize = 0;
+    }else {
+      m_ctx.make(m_stack, m_stacksize, &Fiber::MainFunc);
+    }
+    m_state = INIT;
+  }
+
+  void Fiber::call() {
+    SetThis(this);
+    if(m_sharedStack) {
+      m_sharedStack->enter(this);
+    }
+    m_state = EXEC;
+    Context::Swap(t_threadFiber->m_ctx, m_ctx);
+  }
+
+  void Fiber::back() {
+    SetThis(t_threadFiber.get());
+    if(m_sharedStack) {
+      m_sharedStack->leave(this);
+    }
+    Context::Swap(m_ctx, t_threadFiber->m_ctx);
+  }
+
+  Fiber::State Fiber::swapIn() {
+    //woken while the thread it yielded on is still switching away from it
+    while(m_live.load(std::memory_order_acquire)) {
+      std::this_thread::yield();
+    }
+    SetThis(this);
+    LOONGSERVER_ASSERT(m_state != EXEC);
+    if(m_sharedStack) {
+      m_sharedStack->enter(this);
+    }
+    m_state = EXEC;
+    m_live.store(true, std::memory_order_relaxed);
+    Context::Swap(GetReturnFiber()->m_ctx, m_ctx);
+
+    //the context is saved, once m_live is clear another thread may resume it
+    State state = m_state;
+    if(state == EXEC) {
+      state = HOLD;
+      m_state = HOLD;
+    }
+    m_live.store(false, std::memory_order_release);
+    return state;
+  }
+
+  void Fiber::swapOut() {
+    Fiber* main = GetReturnFiber();
+    SetThis(main);
+    if(m_sharedStack) {
+      m_sharedStack->leave(this);
+    }
+    Context::Swap(m_ctx, main->m_ctx);
+  }
+
+  void Fiber::SetThis(Fiber* f) {
+    t_fiber = f;
+  }
+
+  Fiber::spFIBER Fiber::GetThis() {
+    if(t_fiber) {
+      return t_fiber->shared_from_this();
+    }
+    Fiber::spFIBER main_fiber(new Fiber);
+    LOONGSERVER_ASSERT(t_fiber == main_fiber.get());
+    t_threadFiber = main_fiber;
+    return t_fiber->shared_from_this();
+  }
+
+  void Fiber::YieldToReady() {
+    Fiber::spFIBER cur = GetThis();
+    LOONGSERVER_ASSERT(cur->m_state == EXEC);
+    cur->m_state = READY;
+    cur->swapOut();
+  }
+
+  void Fiber::YieldToHold() {
+    Fiber::spFIBER cur = GetThis();
+    LOONGSERVER_ASSERT(cur->m_state == EXEC);
+    cur->m_state = HOLD;
+    cur->swapOut();
+  }
+
+  uint64_t Fiber::TotalFibers() {
+    return s_fiber_count;
+  }
+
+  void Fiber::MainFunc() {
+    Fiber::spFIBER cur = GetThis();
+    LOONGSERVER_ASSERT(cur);
+    try {
+      cur->m_cb();
+      cur->m_cb = nullptr;
+      cur->m_state = TERM;
+    } catch (std::exception& ex) {
+      cur->m_state = EXCEPT;
+      LOONGSERVER_LOG_ERROR(g_logger) << "Fiber Except: " << ex.what()
+          << " fiber_id=" << cur->getId()
+          << std::endl
+          << loongserver::BacktraceToString();
+    } catch (...) {
+      cur->m_state = EXCEPT;
+      LOONGSERVER_LOG_ERROR(g_logger) << "Fiber Except"
+          << " fiber_id=" << cur->getId()
+          << std::endl
+          << loongserver::BacktraceToString();
+    }
+
+    //the context never returns, drop the reference before leaving for good
+    auto raw_ptr = cur.get();
+    cur.reset();
+    raw_ptr->swapOut();
+
+    LOONGSERVER_ASSERT2(false, "never reach fiber_id=" + std::to_string(raw_ptr->getId()));
+  }
+
+  void Fiber::CallerMainFunc() {
+    Fiber::spFIBER cur = GetThis();
+    LOONGSERVER_ASSERT(cur);
+    try {
+      cur->m_cb();
+      cur->m_cb = nullptr;
+      cur->m_state = TERM;
+    } catch (std::exception& ex) {
+      cur->m_state = EXCEPT;
+      LOONGSERVER_LOG_ERROR(g_logger) << "Fiber Except: " << ex.what()
+          << " fiber_id=" << cur->getId()
+          << std::endl
+          << loongserver::BacktraceToString();
+    } catch (...) {
+      cur->m_state = EXCEPT;
+      LOONGSERVER_LOG_ERROR(g_logger) << "Fiber Except"
+          << " fiber_id=" << cur->getId()
+          << std::endl
+          << loongserver::BacktraceToString();
+    }
+
+    auto raw_ptr = cur.get();
+    cur.reset();
+    raw_ptr->back();
+
+    LOONGSERVER_ASSERT2(false, "never reach fiber_id=" + std::to_string(raw_ptr->getId()));
+  }
+
+  static ConfigVar<uint32_t>::spCV g_fiber_pool_max = 
+    Config::Lookup<uint32_t>("fiber.pool_max", 64, "finished fibers cached per thread for reuse");
+
+  static std::atomic<uint64_t> s_fiber_pool_hits {0};
+  static std::atomic<uint64_t> s_fiber_pool_misses {0};
+  static std::atomic<uint64_t> s_fiber_pool_recycled {0};
+  static std::atomic<uint64_t> s_fiber_pool_dropped {0};
+
+  static thread_local std::vector<Fiber::spFIBER> t_fiberPool;
+
+  Fiber::spFIBER FiberPool::Get(std::function<void()> cb, size_t stacksize) {
+    size_t size = stacksize ? stacksize : g_fiber_stack_size->getValue();
+    for(size_t i = t_fiberPool.size(); i > 0; --i) {
+      if(t_fiberPool[i - 1]->m_stacksize == size) {
+        Fiber::spFIBER f = std::move(t_fiberPool[i - 1]);
+        t_fiberPool.erase(t_fiberPool.begin() + i - 1);
+        f->m_id = ++s_fiber_id;
+        f->reset(std::move(cb));
+        s_fiber_pool_hits.fetch_add(1, std::memory_order_relaxed);
+        return f;
+      }
+    }
+    s_fiber_pool_misses.fetch_add(1, std::memory_order_relaxed);
+    return std::make_shared<Fiber>(std::move(cb), size);
+  }
+
+  bool FiberPool::Put(Fiber::spFIBER& f) {
+    Fiber::spFIBER fiber = std::move(f);
+    if(!fiber) {
+      return false;
+    }
+    Fiber::State state = fiber->m_state;
+    //a fiber somebody still holds may be resumed through that reference
+    if(!fiber->m_stack || fiber.use_count() != 1
+        || (state != Fiber::INIT && state != Fiber::TERM && state != Fiber::EXCEPT)
+        || t_fiberPool.size() >= g_fiber_pool_max->getValue()) {
+      s_fiber_pool_dropped.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    //release what the last callback captured now, not at the next Get
+    fiber->m_cb = nullptr;
+    t_fiberPool.push_back(std::move(fiber));
+    s_fiber_pool_recycled.fetch_add(1, std::memory_order_relaxed);
+    return true;
+  }
+
+  size_t FiberPool::GetSize() {
+    return t_fiberPool.size();
+  }
+
+  void FiberPool::Clear() {
+    t_fiberPool.clear();
+  }
+
+  FiberPool::Stats FiberPool::GetStats() {
+    Stats stats;
+    stats.hits = s_fiber_pool_hits.load(std::memory_order_relaxed);
+    stats.misses = s_fiber_pool_misses.load(std::memory_order_relaxed);
+    stats.recycled = s_fiber_pool_recycled.load(std::memory_order_relaxed);
+    stats.dropped = s_fiber_pool_dropped.load(std::memory_order_relaxed);
+    return stats;
+  }
 }
@@ -2,13 +2,21 @@
 #define __SYLAR_FIBER_H__
 
 #include <memory>
-#include <ucontext.h>
+#include <atomic>
+#include <functional>
+#include <sys/types.h>
+
+#include "context.h"
 
 namespace loongserver {
   class Scheduler;
+  class FiberPool;
+  struct SharedStack;
 
   class Fiber : public std::enable_shared_from_this<Fiber> {
     friend class Scheduler;
+    friend class FiberPool;
+    friend struct SharedStack;
   public:
     using spFIBER = std::shared_ptr<Fiber>;
 
@@ -36,8 +44,15 @@ namespace loongserver {
      * @param[in] function
      * @param[in] stack size
      * @param[in] be called on main fiber
+     * @param[in] run on a stack shared with other fibers of this thread,
+     *            stacksize is ignored and the used part of the stack is
+     *            copied out while another fiber runs on it
+     * @attention a shared-stack fiber must always be resumed by the thread
+     *            which created it, and pointers into its stack are only
+     *            valid while it runs
      */
-    Fiber(std::function<void()> cb, size_t stacksize = 0, bool use_caller = false);
+    Fiber(std::function<void()> cb, size_t stacksize = 0, bool use_caller = false
+          ,bool shared_stack = false);
     /**
      * @brief deconstructor
      */
@@ -52,10 +67,13 @@ namespace loongserver {
 
     /**
      * @brief swap current fiber running
+     * @details if the fiber was woken on another thread before it finished
+     *          switching out there, waits until its context is saved
      * @pre getStatus() != EXEC
-     * @post getStatus() == EXEC
+     * @return state the fiber left with, read before anybody may resume it
+     *         again; a fiber swapped out without a yield is HOLD
      */
-    void swapIn();
+    State swapIn();
 
     /**
      * @brief swap current fiber to background
@@ -87,6 +105,11 @@ namespace loongserver {
      */
     State getState() const {return m_state;}
 
+    /**
+     * @brief return stack size, 0 for the main fiber of a thread
+     */
+    uint32_t getStackSize() const {return m_stacksize;}
+
   public:
     /**
      * @brief set fiber of current thread
@@ -136,15 +159,81 @@ namespace loongserver {
     uint64_t m_id = 0;
     /// @brief stack size 
     uint32_t m_stacksize = 0;
-    /// @brief fiber status
-    State m_state = INIT;
+    /**
+     * @brief fiber status
+     * @details changed by the fiber itself while it runs and by swapIn; a
+     *          yield publishes it before the context is saved, m_live covers
+     *          that window
+     */
+    std::atomic<State> m_state {INIT};
+    /// @brief the context is in use, set by swapIn until the fiber is back out
+    std::atomic<bool> m_live {false};
     /// @brief fiber context
-    ucontext_t m_ctx;
+    Context m_ctx;
     /// @brief fiber running stack pointer
     void* m_stack = nullptr;
     /// @brief fiber execution function
     std::function<void()> m_cb;
+    /// @brief stack shared with other fibers, m_stack is null then
+    std::shared_ptr<SharedStack> m_sharedStack;
+    /// @brief used part of the shared stack, saved while another fiber runs on it
+    char* m_saved = nullptr;
+    size_t m_savedSize = 0;
+    size_t m_savedCap = 0;
+    /// @brief lowest shared stack address in use when the fiber left it
+    char* m_stackLow = nullptr;
+    /// @brief thread owning the shared stack, the only one which may resume the fiber
+    pid_t m_stackThread = 0;
+  };
+
+  /**
+   * @brief per-thread cache of finished fibers
+   * @details Get resets a cached fiber with the new callback, keeping its
+   *          stack and sparing the allocation; Put takes a finished fiber
+   *          back. Size is bounded by fiber.pool_max, counters are global.
+   */
+  class FiberPool {
+  public:
+    struct Stats {
+      /// @brief Get served from the cache
+      uint64_t hits = 0;
+      /// @brief Get which had to create a fiber
+      uint64_t misses = 0;
+      /// @brief fibers taken back by Put
+      uint64_t recycled = 0;
+      /// @brief fibers Put refused, still referenced or cache full
+      uint64_t dropped = 0;
+    };
+
+    /**
+     * @brief return a fiber in INIT state running cb
+     * @param[in] stacksize 0 means fiber.stack_size
+     * @details a cached fiber gets a new id, as if it was created
+     */
+    static Fiber::spFIBER Get(std::function<void()> cb, size_t stacksize = 0);
+
+    /**
+     * @brief give back a fiber in INIT, TERM or EXCEPT state
+     * @pre f is not a use_caller fiber
+     * @return true if cached, f is empty afterwards either way
+     */
+    static bool Put(Fiber::spFIBER& f);
+
+    /**
+     * @brief return fibers cached by the calling thread
+     */
+    static size_t GetSize();
+
+    /**
+     * @brief destroy fibers cached by the calling thread
+     */
+    static void Clear();
+
+    /**
+     * @brief return counters summed over all threads
+     */
+    static Stats GetStats();
   };
 }
 
-#endif
+#endif
\ No newline at end of file
@@ -4,6 +4,23 @@
 #include <stdarg.h>
 #include <map>
 #include <functional>
+#include <chrono>
+#include <algorithm>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <zlib.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <signal.h>
+#include <execinfo.h>
+#include <sched.h>
+#include <poll.h>
+#include <limits.h>
+#include <set>
+#include <cmath>
 
 
 namespace loongserver {
@@ -17,6 +34,7 @@ namespace loongserver {
         XX(DEBUG);
         XX(INFO);
         XX(WARN);
+        XX(ERROR);
         XX(FATAL);
       #undef XX
         default:
@@ -45,10 +63,150 @@ namespace loongserver {
     #undef XX
   }
 
-  LogEventWrap::LogEventWrap(LogEvent::spLE e) : m_event(e){}
+  LogEventWrap::LogEventWrap(LogEvent::spLE e) : m_event(std::move(e)){}
 
   LogEventWrap::~LogEventWrap(){
-    m_event->getLogger()->log(m_event->getLevel(), m_event);
+    Logger* logger = m_event->getLogger();
+    LogLevel::Level level = m_event->getLevel();
+    logger->log(level, std::move(m_event));
+  }
+
+  void LogStream::grow(size_t n) {
+    size_t cap = m_cap * 2;
+    while(cap < n) {
+      cap *= 2;
+    }
+    char* data = static_cast<char*>(malloc(cap));
+    memcpy(data, m_data, m_size);
+    if(m_data != m_inline) {
+      free(m_data);
+    }
+    m_data = data;
+    m_cap = cap;
+  }
+
+  void LogStream::appendFormat(const char* fmt, va_list al) {
+    va_list copy;
+    va_copy(copy, al);
+    size_t avail = m_cap - m_size;
+    int len = vsnprintf(m_data + m_size, avail, fmt, copy);
+    va_end(copy);
+    if(len < 0) {
+      return;
+    }
+    //vsnprintf needs one more byte for the terminating null
+    if((size_t)len >= avail) {
+      grow(m_size + len + 1);
+      vsnprintf(m_data + m_size, len + 1, fmt, al);
+    }
+    m_size += len;
+  }
+
+  void LogStream::appendUInt(uint64_t val) {
+    char buf[24];
+    char* p = buf + sizeof(buf);
+    do {
+      *--p = '0' + val % 10;
+      val /= 10;
+    } while(val);
+    append(p, buf + sizeof(buf) - p);
+  }
+
+  void LogStream::appendInt(int64_t val) {
+    if(val < 0) {
+      append("-", 1);
+      appendUInt(0 - static_cast<uint64_t>(val));
+    }else {
+      appendUInt(val);
+    }
+  }
+
+  LogStream& LogStream::operator<<(double v) {
+    if(m_formatted) {
+      return writeStream(v);
+    }
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "%.12g", v);
+    append(buf, len);
+    return *this;
+  }
+
+  LogStream& LogStream::operator<<(const void* v) {
+    if(m_formatted) {
+      return writeStream(v);
+    }
+    char buf[24];
+    int len = snprintf(buf, sizeof(buf), "%p", v);
+    append(buf, len);
+    return *this;
+  }
+
+  //blocks kept per thread before they go back to the heap
+  static const size_t s_event_pool_max = 1024;
+
+  struct LogEventFreeList {
+    size_t              size {0};
+    std::vector<void*>  blocks;
+  };
+
+  struct LogEventPoolData {
+    //allocate_shared asks for a single size, a few lists are plenty
+    LogEventFreeList lists[4];
+
+    ~LogEventPoolData();
+  };
+
+  static thread_local LogEventPoolData t_eventPool;
+  //set once t_eventPool is destroyed, blocks freed later go to the heap
+  static thread_local bool t_eventPoolGone = false;
+
+  LogEventPoolData::~LogEventPoolData() {
+    t_eventPoolGone = true;
+    for(auto& l : lists) {
+      for(auto p : l.blocks) {
+        ::operator delete(p);
+      }
+    }
+  }
+
+  void* LogEventPool::Alloc(size_t size) {
+    if(!t_eventPoolGone) {
+      for(auto& l : t_eventPool.lists) {
+        if(l.size == size && !l.blocks.empty()) {
+          void* p = l.blocks.back();
+          l.blocks.pop_back();
+          return p;
+        }
+      }
+    }
+    return ::operator new(size);
+  }
+
+  void LogEventPool::Dealloc(void* ptr, size_t size) {
+    if(!t_eventPoolGone) {
+      for(auto& l : t_eventPool.lists) {
+        if(l.size == 0) {
+          l.size = size;
+          l.blocks.reserve(s_event_pool_max);
+        }
+        if(l.size == size) {
+          if(l.blocks.size() < s_event_pool_max) {
+            l.blocks.push_back(ptr);
+            return;
+          }
+          break;
+        }
+      }
+    }
+    ::operator delete(ptr);
+  }
+
+  LogEvent::spLE LogEvent::Create(const std::shared_ptr<Logger>& logger, LogLevel::Level level
+            ,const char* file, int32_t line, uint64_t elapse
+            ,uint32_t thread_id, uint32_t fiber_id, uint64_t time
+            ,uint32_t thread_name_id) {
+    return std::allocate_shared<LogEvent>(LogEventAllocator<LogEvent>(), logger, level
+              ,file, line, elapse, thread_id, fiber_id, time, thread_name_id);
   }
 
   void LogEvent::format(const char* fmt, ...){
@@ -59,15 +217,10 @@ namespace loongserver {
   }
 
   void LogEvent::format(const char* fmt, va_list al){
-    char* buf = nullptr;
-    int len = vasprintf(&buf, fmt, al);
-    if(len != -1){
-      m_ss << std::string(buf, len);
-      free(buf);
-    }
+    m_ss.appendFormat(fmt, al);
   }
 
-  std::stringstream& LogEventWrap::getSS() {
+  LogStream& LogEventWrap::getSS() {
     return m_event->getSS();
   }
 
@@ -80,343 +233,2386 @@ namespace loongserver {
       m_hasFormatter = false;
     }
   }
+
+  void LogAppender::resetFormatter(LogFormatter::spLF val) {
+    MUTEXTYPE::Lock lock(m_mutex);
+    m_formatter = val;
+    m_hasFormatter = false;
+  }
   
   LogFormatter::spLF LogAppender::getFormatter() {
     MUTEXTYPE::Lock lock(m_mutex);
     return m_formatter;
   }
 
-  class MessageFormatItem : public LogFormatter::FormatItem {
-  public:
-    MessageFormatItem(const std::string& str = "") {}
-    void format(std::ostream& os, Logger::spLOGGER Logger, LogLevel::Level level, LogEvent::spLE event) override {
-      os << event->getContent();
-    }
+  //formatted line of the calling thread, reused by every appender
+  static thread_local LogStream t_formatBuffer;
+
+  //distinct formatters one dispatch renders once, more are rendered per appender
+  static const size_t s_render_cache_size = 4;
+
+  /**
+   * @brief output rendered during one Logger::dispatch, keyed by formatter id
+   * @details scopes nest when an appender logs, buffers of a nested scope are
+   *          taken after the ones of its parent and handed back on exit
+   */
+  struct LogRenderScope {
+    LogRenderScope();
+    ~LogRenderScope();
+
+    uint64_t        ids[s_render_cache_size];
+    LogStream*      bufs[s_render_cache_size];
+    size_t          count {0};
+    size_t          base;
+    LogRenderScope* prev;
   };
 
-  class LevelFormatItem : public LogFormatter::FormatItem {
-  public:
-    LevelFormatItem(const std::string& str = "") {}
-    void format(std::ostream& os, Logger::spLOGGER logger, LogLevel::Level level, LogEvent::spLE event) override {
-      os << LogLevel::ToString(level);
+  static thread_local std::vector<std::unique_ptr<LogStream>> t_renderBuffers;
+  static thread_local size_t t_renderBuffersUsed = 0;
+  static thread_local LogRenderScope* t_renderScope = nullptr;
+
+  LogRenderScope::LogRenderScope()
+    :base(t_renderBuffersUsed)
+    ,prev(t_renderScope) {
+    t_renderScope = this;
+  }
+
+  LogRenderScope::~LogRenderScope() {
+    t_renderScope = prev;
+    t_renderBuffersUsed = base;
+  }
+
+  const LogStream& LogAppender::render(Logger* logger, LogLevel::Level level, const LogEvent& event) {
+    LogRenderScope* scope = t_renderScope;
+    LogStream* buf = &t_formatBuffer;
+    if(scope) {
+      uint64_t id = m_formatter->getId();
+      for(size_t i = 0; i < scope->count; ++i) {
+        if(scope->ids[i] == id) {
+          return *scope->bufs[i];
+        }
+      }
+      if(scope->count < s_render_cache_size) {
+        if(t_renderBuffersUsed == t_renderBuffers.size()) {
+          t_renderBuffers.emplace_back(new LogStream);
+        }
+        buf = t_renderBuffers[t_renderBuffersUsed++].get();
+        scope->ids[scope->count] = id;
+        scope->bufs[scope->count++] = buf;
+      }
     }
-  };
+    buf->clear();
+    m_formatter->format(*buf, logger, level, event);
+    return *buf;
+  }
+
+  //%m %p %c %t %F %l %d %n %T are compiled into LogFormatter opcodes
 
   class ElapseFormatItem : public LogFormatter::FormatItem {
   public:
-    ElapseFormatItem(const std::string& str = "") {}
-    void format(std::ostream& os, Logger::spLOGGER logger, LogLevel::Level level, LogEvent::spLE event) override {
-      os << event->getElapse();
+    ElapseFormatItem(const std::string& str = "") {
+      if(str == "us") {
+        m_divisor = 1000;
+      }else if(str == "ns") {
+        m_divisor = 1;
+      }
     }
+    void format(LogStream& os, Logger* logger, LogLevel::Level level, const LogEvent& event) override {
+      os.appendUInt(event.getElapse() / m_divisor);
+    }
+  private:
+    uint64_t m_divisor = 1000 * 1000;
   };
 
-  class NameFormatItem : public LogFormatter::FormatItem {
+  class ThreadNameFormatItem : public LogFormatter::FormatItem {
   public:
-    NameFormatItem(const std::string& str = "") {}
-    void format(std::ostream& os, Logger::spLOGGER logger, LogLevel::Level level, LogEvent::spLE event) override {
-      os << event->getLogger()->getName();
+    ThreadNameFormatItem(const std::string& std = "") {}
+    void format(LogStream& os, Logger* logger, LogLevel::Level level, const LogEvent& event) override {
+      os << Thread::GetNameById(event.getThreadNameId());
     }
   };
 
-  class ThreadIdFormatItem : public LogFormatter::FormatItem {
+  class FilenameFormatItem : public LogFormatter::FormatItem {
   public:
-    ThreadIdFormatItem(const std::string& str = "") {}
-    void format(std::ostream& os, Logger::spLOGGER logger, LogLevel::Level level, LogEvent::spLE event) override {
-      os << event->getThreadId();
+    FilenameFormatItem(const std::string& str = "") {}
+    void format(LogStream& os, Logger* logger, LogLevel::Level level, const LogEvent& event) override {
+      os << event.getfile();
     }
   };
 
-  class FiberIdFormatItem : public LogFormatter::FormatItem {
-  public:
-    FiberIdFormatItem(const std::string& str = "") {}
-    void format(std::ostream& os, Logger::spLOGGER logger, LogLevel::Level level, LogEvent::spLE event) override {
-      os << event->getFiberId();
+  LogEvent::LogEvent(const std::shared_ptr<Logger>& logger, LogLevel::Level level
+            ,const char* file, int32_t line, uint64_t elapse
+            ,uint32_t thread_id, uint32_t fiber_id, uint64_t time
+            ,uint32_t thread_name_id) 
+            : m_file(file)
+            ,m_line(line)
+            ,m_elapse(elapse)
+            ,m_threadId(thread_id)
+            ,m_fiberId(fiber_id)
+            ,m_time(time / 1000000)
+            ,m_usec(time % 1000000)
+            ,m_threadNameId(thread_name_id)
+            ,m_logger(logger.get())
+            ,m_level(level){
+    m_ss.setFields(&m_fields);
+  }
+
+  void LogFields::add(const LogKV& kv) {
+    if(m_count == MAX_FIELDS) {
+      ++m_dropped;
+      return;
     }
-  };
+    Field& f = m_fields[m_count++];
+    f.key = m_data.size();
+    f.keyLen = strlen(kv.key);
+    f.type = kv.type;
+    m_data.append(kv.key, f.keyLen);
+    switch(kv.type) {
+      case LogKV::INT:
+        f.i = kv.i;
+        break;
+      case LogKV::UINT:
+        f.u = kv.u;
+        break;
+      case LogKV::DOUBLE:
+        f.d = kv.d;
+        break;
+      case LogKV::BOOL:
+        f.b = kv.b;
+        break;
+      case LogKV::STRING:
+        f.s.off = m_data.size();
+        f.s.len = kv.s.len;
+        m_data.append(kv.s.data, kv.s.len);
+        break;
+    }
+  }
 
-  class ThreadNameFormatItem : public LogFormatter::FormatItem {
-  public:
-    ThreadNameFormatItem(const std::string& std = "") {}
-    void format(std::ostream& os, Logger::spLOGGER logger, LogLevel::Level level, LogEvent::spLE event) override {
-      os << event->getThreadName();
+  LogStream& operator<<(LogStream& os, const LogKV& v) {
+    if(os.getFields()) {
+      os.getFields()->add(v);
+      return os;
     }
+    os << v.key << '=';
+    switch(v.type) {
+      case LogKV::INT:
+        os.appendInt(v.i);
+        break;
+      case LogKV::UINT:
+        os.appendUInt(v.u);
+        break;
+      case LogKV::DOUBLE:
+        os << v.d;
+        break;
+      case LogKV::BOOL:
+        os << v.b;
+        break;
+      case LogKV::STRING:
+        os.append(v.s.data, v.s.len);
+        break;
+    }
+    return os;
+  }
+
+  //readers and retired objects of LogEpoch
+  struct LogEpochSlot {
+    //epoch the owning thread entered at, 0 when outside any Guard
+    std::atomic<uint64_t>   epoch {0};
+    std::atomic<bool>       used {true};
+    LogEpochSlot*           next {nullptr};
+    char                    pad[64];
   };
 
-  class DateTimeFormatItem : public LogFormatter::FormatItem {
-  public:
-    DateTimeFormatItem(const std::string& format = "%Y-%m-%d %H:%M:%S") : m_format(format) {
-      if(m_format.empty())
-        m_format = "Y-%m-%d %H:%M:%S";
+  struct LogEpochThread {
+    ~LogEpochThread();
+    LogEpochSlot*   slot {nullptr};
+    uint32_t        depth {0};
+  };
+
+  static std::atomic<uint64_t> s_epoch {1};
+  //slots are never freed, a slot of an exited thread is reused
+  static std::atomic<LogEpochSlot*> s_epochSlots {nullptr};
+  static std::mutex s_epochRetireMutex;
+  static std::vector<std::function<void()>> s_epochRetired;
+  //callbacks in s_epochRetired, left for the outermost Guard to run
+  static std::atomic<size_t> s_epochRetiredCount {0};
+  static thread_local LogEpochThread t_epoch;
+
+  LogEpochThread::~LogEpochThread() {
+    if(slot) {
+      slot->epoch.store(0, std::memory_order_release);
+      slot->used.store(false, std::memory_order_release);
+      slot = nullptr;
     }
+  }
 
-    void format(std::ostream& os, Logger::spLOGGER logger, LogLevel::Level level, LogEvent::spLE event) override {
-      struct tm tm;
-      time_t time = event->getTime();
-      localtime_r(&time, &tm);
-      char buf[64];
-      strftime(buf, sizeof(buf), m_format.c_str(), &tm);
-      os << buf;
+  static LogEpochSlot* AcquireEpochSlot() {
+    for(LogEpochSlot* i = s_epochSlots.load(std::memory_order_acquire); i; i = i->next) {
+      bool used = false;
+      if(!i->used.load(std::memory_order_relaxed)
+          && i->used.compare_exchange_strong(used, true)) {
+        return i;
+      }
     }
-  
-  private:
-    std::string m_format;
-  };
+    LogEpochSlot* slot = new LogEpochSlot;
+    slot->next = s_epochSlots.load(std::memory_order_relaxed);
+    while(!s_epochSlots.compare_exchange_weak(slot->next, slot));
+    return slot;
+  }
 
-  class FilenameFormatItem : public LogFormatter::FormatItem {
-  public:
-    FilenameFormatItem(const std::string& str = "") {}
-    void format(std::ostream& os, Logger::spLOGGER, LogLevel::Level level, LogEvent::spLE event) override {
-      os << event->getfile();
+  void LogEpoch::Enter() {
+    if(t_epoch.depth++) {
+      return;
     }
-  };
+    if(!t_epoch.slot) {
+      t_epoch.slot = AcquireEpochSlot();
+    }
+    //must be visible before any published pointer is loaded; store then
+    //load needs the fence, Synchronize bumps s_epoch and then scans slots
+    t_epoch.slot->epoch.store(s_epoch.load(std::memory_order_relaxed));
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+  }
 
-  class LineFormatItem : public LogFormatter::FormatItem {
-  public:
-    LineFormatItem(const std::string& str = "") {}
-    void format(std::ostream& os, Logger::spLOGGER logger, LogLevel::Level level, LogEvent::spLE event) override {
-      os << event->getLine();
+  void LogEpoch::Leave() {
+    if(--t_epoch.depth == 0) {
+      t_epoch.slot->epoch.store(0, std::memory_order_release);
+      if(s_epochRetiredCount.load(std::memory_order_relaxed)) {
+        RunRetired();
+      }
     }
-  };
+  }
 
-  class NewLineFormatItem : public LogFormatter::FormatItem {
-  public:
-    NewLineFormatItem(const std::string& str = "") {}
-    void format(std::ostream& os, Logger::spLOGGER Logger, LogLevel::Level level, LogEvent::spLE event) override {
-      os << event->getLine();
+  void LogEpoch::Synchronize() {
+    uint64_t target = s_epoch.fetch_add(1) + 1;
+    for(LogEpochSlot* i = s_epochSlots.load(); i; i = i->next) {
+      while(true) {
+        uint64_t e = i->epoch.load();
+        if(e == 0 || e >= target) {
+          break;
+        }
+        std::this_thread::yield();
+      }
     }
-  };
+  }
 
-  class StringFormatItem : public LogFormatter::FormatItem {
-  public:
-    StringFormatItem(const std::string& str) : m_string(str) {}
-    void format(std::ostream& os, Logger::spLOGGER Logger, LogLevel::Level level, LogEvent::spLE event) override {
-      os << m_string;
+  void LogEpoch::Retire(std::function<void()> cb) {
+    {
+      std::lock_guard<std::mutex> lock(s_epochRetireMutex);
+      s_epochRetired.push_back(std::move(cb));
+      s_epochRetiredCount.store(s_epochRetired.size(), std::memory_order_relaxed);
     }
-  private:
-    std::string m_string;
+    //waiting here would wait on ourselves, Leave runs it
+    if(!t_epoch.depth) {
+      RunRetired();
+    }
+  }
+
+  void LogEpoch::RunRetired() {
+    std::vector<std::function<void()>> ready;
+    {
+      std::lock_guard<std::mutex> lock(s_epochRetireMutex);
+      ready.swap(s_epochRetired);
+      s_epochRetiredCount.store(0, std::memory_order_relaxed);
+    }
+    if(ready.empty()) {
+      return;
+    }
+    Synchronize();
+    for(auto& i : ready) {
+      i();
+    }
+  }
+
+  std::atomic<uint64_t> Logger::s_levelGeneration {1};
+
+  //every live logger, their cached effective levels are reset by setLevel
+  struct LoggerLevelRegistry {
+    std::mutex            mutex;
+    std::vector<Logger*>  loggers;
   };
 
-  class TabFormatItem : public LogFormatter::FormatItem {
-  public:
-    TabFormatItem(const std::string& str = "") {}
-    void format(std::ostream& os, Logger::spLOGGER logger, LogLevel::Level level, LogEvent::spLE event) override {
-      os << "\t";
+  static LoggerLevelRegistry& GetLoggerLevelRegistry() {
+    static LoggerLevelRegistry* s_registry = new LoggerLevelRegistry;
+    return *s_registry;
+  }
+
+  Logger::Logger(const std::string& name)
+          : m_name(name) {
+            m_formatter = std::make_shared<LogFormatter>("%d{%Y-%m-%d %H:%M:%S}%T%t%T%N%T%F%T[%p]%T[%c]%T%f:%l%T%m%n");
+            m_appenders = new AppenderList;
+            auto& registry = GetLoggerLevelRegistry();
+            std::lock_guard<std::mutex> lock(registry.mutex);
+            registry.loggers.push_back(this);
+  }
+
+  Logger::~Logger() {
+    {
+      auto& registry = GetLoggerLevelRegistry();
+      std::lock_guard<std::mutex> lock(registry.mutex);
+      auto it = std::find(registry.loggers.begin(), registry.loggers.end(), this);
+      if(it != registry.loggers.end()) {
+        registry.loggers.erase(it);
+      }
+    }
+    //nobody can log through a logger whose last reference is gone
+    delete m_appenders.load();
+  }
+
+  void Logger::setLevel(LogLevel::Level val) {
+    auto& registry = GetLoggerLevelRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    m_level.store(val, std::memory_order_relaxed);
+    //readers which see a reset entry also see the new generation and level
+    uint64_t generation = s_levelGeneration.fetch_add(1, std::memory_order_acq_rel) + 1;
+    for(auto i : registry.loggers) {
+      i->m_effective.store(generation << 8, std::memory_order_release);
+    }
+  }
+
+  LogLevel::Level Logger::getEffectiveLevel() {
+    uint64_t e = m_effective.load(std::memory_order_relaxed);
+    if((e & 0xff) != LogLevel::UNKONWN
+        && (e >> 8) == s_levelGeneration.load(std::memory_order_relaxed)) {
+      return (LogLevel::Level)(e & 0xff);
+    }
+    return refreshEffectiveLevel();
+  }
+
+  LogLevel::Level Logger::refreshEffectiveLevel() {
+    uint64_t e = m_effective.load(std::memory_order_acquire);
+    uint64_t generation = s_levelGeneration.load(std::memory_order_acquire);
+    LogLevel::Level level = LogLevel::UNKONWN;
+    for(Logger* i = this; i && level == LogLevel::UNKONWN; i = i->m_parent.get()) {
+      level = i->m_level.load(std::memory_order_relaxed);
+    }
+    if(level == LogLevel::UNKONWN) {
+      level = LogLevel::DEBUG;
+    }
+    //lost to a concurrent setLevel, which left a reset entry behind
+    m_effective.compare_exchange_strong(e, generation << 8 | level, std::memory_order_relaxed);
+    return level;
+  }
+
+  void Logger::setFormatter(LogFormatter::spLF val) {
+    MUTEXTYPE::Lock lock(m_mutex);
+    m_formatter = val;
+
+    //assign formatter for eveny appender
+    for(auto& i : *m_appenders.load()) {
+      MUTEXTYPE::Lock ll(i->m_mutex);
+      if(!i->m_hasFormatter) {
+        i->m_formatter = m_formatter;
+      }
+    }
+  }
+
+  void Logger::setFormatter(const std::string& val) {
+    std::cout << "---" << val << std::endl;
+    loongserver::LogFormatter::spLF new_val = loongserver::LogFormatter::Create(val);
+    if(new_val->isError()){
+      std::cout << "Logger setFormatter name=" << m_name
+                << " value=" << val << " invalid formatter"
+                << std::endl;
+      return;
+    }
+    setFormatter(new_val);
+  }
+
+  std::string Logger::toYamlString() {
+    MUTEXTYPE::Lock lock(m_mutex);
+    YAML::Node node;
+    node["name"] = m_name;
+    if(m_level != LogLevel::UNKONWN) {
+      node["level"] = LogLevel::ToString(m_level);
+    }
+    if(m_formatter) {
+      node["formatter"] = m_formatter->getPattern();
+    }
+
+    for(auto& i : *m_appenders.load()){
+      node["appenders"].push_back(YAML::Load(i->toYamlString()));
+    }
+    std::stringstream ss;
+    ss << node;
+    return ss.str();
+  }
+
+  LogFormatter::spLF Logger::getFormatter() {
+    MUTEXTYPE::Lock lock(m_mutex);
+    return m_formatter;
+  }
+
+  Logger::AppenderList* Logger::publishAppenders(AppenderList* list) {
+    return m_appenders.exchange(list);
+  }
+
+  void Logger::addAppender(LogAppender::spLA appender){
+    AppenderList* old = nullptr;
+    {
+      MUTEXTYPE::Lock lock(m_mutex);
+      if(!appender->getFormatter()){
+        MUTEXTYPE::Lock ll(appender->m_mutex);
+        appender->m_formatter = m_formatter;
+      }
+      AppenderList* list = new AppenderList(*m_appenders.load());
+      list->push_back(appender);
+      old = publishAppenders(list);
+    }
+    //readers may wait on m_mutex inside a guard, retire outside of it
+    LogEpoch::RetireDelete(old);
+  }
+
+  void Logger::delAppender(LogAppender::spLA appender) {
+    AppenderList* old = nullptr;
+    {
+      MUTEXTYPE::Lock lock(m_mutex);
+      AppenderList* cur = m_appenders.load();
+      auto it = std::find(cur->begin(), cur->end(), appender);
+      if(it == cur->end()) {
+        return;
+      }
+      AppenderList* list = new AppenderList(*cur);
+      list->erase(list->begin() + (it - cur->begin()));
+      old = publishAppenders(list);
+    }
+    LogEpoch::RetireDelete(old);
+  }
+
+  void Logger::clearAppenders() {
+    AppenderList* old = nullptr;
+    {
+      MUTEXTYPE::Lock lock(m_mutex);
+      old = publishAppenders(new AppenderList);
+    }
+    LogEpoch::RetireDelete(old);
+  }
+
+  std::vector<LogAppender::spLA> Logger::getAppenders() {
+    MUTEXTYPE::Lock lock(m_mutex);
+    return *m_appenders.load();
+  }
+
+  void Logger::setAppenders(const std::vector<LogAppender::spLA>& appenders) {
+    AppenderList* old = nullptr;
+    {
+      MUTEXTYPE::Lock lock(m_mutex);
+      for(auto& i : appenders) {
+        MUTEXTYPE::Lock ll(i->m_mutex);
+        if(!i->m_hasFormatter) {
+          i->m_formatter = m_formatter;
+        }
+      }
+      old = publishAppenders(new AppenderList(appenders));
+    }
+    LogEpoch::RetireDelete(old);
+  }
+
+  void Logger::log(LogLevel::Level level, LogEvent::spLE event) {
+    if(!isEnabled(level)) {
+      return;
+    }
+    auto pipeline = sLOGPIPELINE::GetInstance();
+    if(pipeline->isRunning() && pipeline->enqueue(shared_from_this(), level, event)) {
+      return;
+    }
+    dispatch(level, event);
+  }
+
+  void Logger::dispatch(LogLevel::Level level, const LogEvent::spLE& event) {
+    LogEpoch::Guard guard;
+    LogRenderScope render_scope;
+    //a logger without appenders writes through its nearest ancestor with some
+    const AppenderList* list = m_appenders.load(std::memory_order_acquire);
+    for(Logger* i = m_parent.get(); list->empty() && i; i = i->m_parent.get()) {
+      list = i->m_appenders.load(std::memory_order_acquire);
+    }
+    for(auto& i : *list) {
+      i->log(this, level, event);
+    }
+  }
+
+  void Logger::debug(LogEvent::spLE event) {
+    log(LogLevel::DEBUG, event);
+  }
+
+  void Logger::info(LogEvent::spLE event) {
+    log(LogLevel::INFO, event);
+  }
+
+  void Logger::warn(LogEvent::spLE event) {
+    log(LogLevel::WARN, event);
+  }
+
+  void Logger::error(LogEvent::spLE event) {
+    log(LogLevel::ERROR, event);
+  }
+
+  void Logger::fatal(LogEvent::spLE event) {
+    log(LogLevel::FATAL, event);
+  }
+
+  //tokens are kept in 1/1000 units in the low bits of LogLimiter::m_state
+  static const uint64_t s_limiter_token_unit = 1000;
+  static const uint64_t s_limiter_token_max = (1ull << 24) - 1;
+
+  //limiters which suppressed records and wait for their summary
+  struct LogLimiterRegistry {
+    std::mutex                mutex;
+    std::vector<LogLimiter*>  limiters;
+    uint64_t                  timer {0};
+  };
+
+  static LogLimiterRegistry& GetLogLimiterRegistry() {
+    //never destroyed, limiters are static objects destroyed at exit too
+    static LogLimiterRegistry* s_registry = new LogLimiterRegistry;
+    return *s_registry;
+  }
+
+  LogLimiter::LogLimiter(Policy policy, uint64_t a, uint64_t b, LogLevel::Level level
+                         ,const char* file, int32_t line)
+    :m_policy(policy)
+    ,m_a(a ? a : 1)
+    ,m_b(b ? b : 1)
+    ,m_level(level)
+    ,m_file(file)
+    ,m_line(line) {
+    if(m_policy == TOKEN_BUCKET) {
+      m_b = std::min(m_b * s_limiter_token_unit, s_limiter_token_max);
+      m_state = (GetMonotonicNS() / 1000000) << 24 | m_b;
+    }
+  }
+
+  LogLimiter::~LogLimiter() {
+    if(m_registered) {
+      auto& registry = GetLogLimiterRegistry();
+      std::lock_guard<std::mutex> lock(registry.mutex);
+      auto it = std::find(registry.limiters.begin(), registry.limiters.end(), this);
+      if(it != registry.limiters.end()) {
+        registry.limiters.erase(it);
+      }
+    }
+  }
+
+  bool LogLimiter::take() {
+    if(m_policy == EVERY_N) {
+      return m_state.fetch_add(1, std::memory_order_relaxed) % m_a == 0;
+    }
+    if(m_policy == FIRST_N_EVERY_M) {
+      uint64_t n = m_state.fetch_add(1, std::memory_order_relaxed);
+      return n < m_a || (n - m_a + 1) % m_b == 0;
+    }
+
+    uint64_t now = GetMonotonicNS() / 1000000;
+    uint64_t old = m_state.load(std::memory_order_relaxed);
+    while(true) {
+      uint64_t last = old >> 24;
+      uint64_t tokens = old & s_limiter_token_max;
+      if(now > last) {
+        tokens = std::min(m_b, tokens + (now - last) * m_a);
+        last = now;
+      }else if(tokens < s_limiter_token_unit) {
+        //empty and nothing to refill, the common case while flooding
+        return false;
+      }
+      bool rt = tokens >= s_limiter_token_unit;
+      if(rt) {
+        tokens -= s_limiter_token_unit;
+      }
+      if(m_state.compare_exchange_weak(old, last << 24 | tokens, std::memory_order_relaxed)) {
+        return rt;
+      }
+    }
+  }
+
+  void LogLimiter::suppress(const std::shared_ptr<Logger>& logger) {
+    m_suppressed.fetch_add(1, std::memory_order_relaxed);
+    if(m_registered.load(std::memory_order_relaxed) || m_registered.exchange(true)) {
+      return;
+    }
+    auto& registry = GetLogLimiterRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    m_logger = logger;
+    registry.limiters.push_back(this);
+    if(!registry.timer) {
+      registry.timer = sLOGHOUSEKEEPER::GetInstance()->addTimer(REPORT_INTERVAL_MS, [](){
+        auto& registry = GetLogLimiterRegistry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        for(auto i : registry.limiters) {
+          i->report();
+        }
+        return true;
+      });
+    }
+  }
+
+  uint64_t LogLimiter::pass(const std::shared_ptr<Logger>& logger) {
+    if(!take()) {
+      suppress(logger);
+      return 0;
+    }
+    if(!m_suppressed.load(std::memory_order_relaxed)) {
+      return 1;
+    }
+    return 1 + m_suppressed.exchange(0, std::memory_order_relaxed);
+  }
+
+  void LogLimiter::report() {
+    if(!m_logger || !m_suppressed.load(std::memory_order_relaxed)) {
+      return;
+    }
+    uint64_t count = m_suppressed.exchange(0, std::memory_order_relaxed);
+    if(!count) {
+      return;
+    }
+    auto event = LogEvent::Create(m_logger, m_level, m_file, m_line, GetMonotonicNS()
+                    ,GetThreadId(), GetFiberId(), GetCoarseCurrentUS(), Thread::GetNameId());
+    event->getSS() << "suppressed " << count << " records in the last "
+                   << REPORT_INTERVAL_MS / 1000 << "s";
+    m_logger->log(m_level, std::move(event));
+  }
+
+  //size of each pre-allocated async buffer
+  static const size_t s_async_buffer_size = 1024 * 1024;
+  //full buffers allowed to wait for the flusher before lines are dropped
+  static const size_t s_async_max_pending = 16;
+
+  LogHousekeeper::LogHousekeeper() {
+    m_thread = std::thread(&LogHousekeeper::run, this);
+  }
+
+  LogHousekeeper::~LogHousekeeper() {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_stopping = true;
+    }
+    m_cond.notify_all();
+    m_thread.join();
+  }
+
+  uint64_t LogHousekeeper::addTimer(uint32_t interval_ms, std::function<bool()> cb) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    uint64_t id = m_nextId++;
+    m_timers[id] = Timer{interval_ms, GetCurrentMS() + interval_ms, std::move(cb)};
+    m_cond.notify_all();
+    return id;
+  }
+
+  void LogHousekeeper::delTimer(uint64_t id) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_timers.erase(id);
+    if(std::this_thread::get_id() != m_thread.get_id()) {
+      m_cond.wait(lock, [this, id]() { return m_runningId != id; });
+    }
+  }
+
+  void LogHousekeeper::post(std::function<void()> task) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_tasks.push_back(std::move(task));
+    m_cond.notify_all();
+  }
+
+  void LogHousekeeper::run() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while(!m_stopping) {
+      if(!m_tasks.empty()) {
+        auto task = std::move(m_tasks.front());
+        m_tasks.pop_front();
+        lock.unlock();
+        task();
+        lock.lock();
+        continue;
+      }
+
+      uint64_t now = GetCurrentMS();
+      uint64_t wait = 1000;
+      for(auto it = m_timers.begin(); it != m_timers.end();) {
+        if(it->second.next <= now) {
+          uint64_t id = it->first;
+          auto cb = it->second.cb;
+          m_runningId = id;
+          lock.unlock();
+          bool keep = cb();
+          lock.lock();
+          m_runningId = 0;
+          m_cond.notify_all();
+
+          //the timer may be gone while the lock was released
+          it = m_timers.find(id);
+          if(it == m_timers.end()) {
+            it = m_timers.upper_bound(id);
+            continue;
+          }
+          if(!keep) {
+            it = m_timers.erase(it);
+            continue;
+          }
+          it->second.next = now + it->second.interval;
+        }
+        wait = std::min(wait, it->second.next - now);
+        ++it;
+      }
+      m_cond.wait_for(lock, std::chrono::milliseconds(wait));
+    }
+  }
+
+  struct LogCrashSlot {
+    std::atomic<LogCrash::FlushFunc> func {nullptr};
+    std::atomic<void*>               arg {nullptr};
+  };
+
+  static LogCrashSlot s_crashSlots[LogCrash::MAX_SLOTS];
+  static std::mutex s_crashSlotMutex;
+  //thread reporting a crash, 0 while the process is healthy
+  static std::atomic<pid_t> s_crashThread {0};
+  static std::atomic<bool> s_crashInstalled {false};
+  static const int s_crash_signals[] = {SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT};
+  static const size_t s_crash_signal_count = sizeof(s_crash_signals) / sizeof(s_crash_signals[0]);
+  static struct sigaction s_crashOldActions[s_crash_signal_count];
+  static const size_t s_crash_stack_size = 64 * 1024;
+  static const int s_crash_max_frames = 64;
+
+  struct LogCrashAltStack {
+    void* stack {nullptr};
+    ~LogCrashAltStack() {
+      if(stack) {
+        stack_t ss;
+        memset(&ss, 0, sizeof(ss));
+        ss.ss_flags = SS_DISABLE;
+        sigaltstack(&ss, nullptr);
+        free(stack);
+      }
+    }
+  };
+
+  static thread_local LogCrashAltStack t_crashAltStack;
+
+  /**
+   * @brief write all of data, async-signal-safe
+   */
+  static void CrashWriteAll(int fd, const char* data, size_t len) {
+    while(len) {
+      ssize_t n = ::write(fd, data, len);
+      if(n < 0 && errno == EINTR) {
+        continue;
+      }
+      if(n <= 0) {
+        return;
+      }
+      data += n;
+      len -= n;
+    }
+  }
+
+  /**
+   * @brief lock m on the crash path
+   * @details the holder may be the crashed thread itself, so give up after a
+   *          while; a taken lock is never released, the process is dying
+   */
+  static bool CrashTryLock(std::mutex& m) {
+    for(int i = 0; i < 1000; ++i) {
+      if(m.try_lock()) {
+        return true;
+      }
+      sched_yield();
+    }
+    return false;
+  }
+
+  /**
+   * @brief fixed size line builder usable inside a signal handler
+   */
+  class LogCrashLine {
+  public:
+    void append(const char* str) {
+      size_t len = std::min(strlen(str), sizeof(m_buf) - m_size);
+      memcpy(m_buf + m_size, str, len);
+      m_size += len;
+    }
+
+    void appendNumber(uint64_t v, unsigned base = 10) {
+      char tmp[24];
+      size_t n = 0;
+      do {
+        tmp[n++] = "0123456789abcdef"[v % base];
+        v /= base;
+      } while(v);
+      while(n && m_size < sizeof(m_buf)) {
+        m_buf[m_size++] = tmp[--n];
+      }
+    }
+
+    void writeTo(int fd) const { CrashWriteAll(fd, m_buf, m_size); }
+
+  private:
+    char   m_buf[256];
+    size_t m_size {0};
+  };
+
+  static const char* CrashSignalName(int sig) {
+    switch(sig) {
+#define XX(name) \
+      case name: \
+        return #name;
+
+      XX(SIGSEGV);
+      XX(SIGBUS);
+      XX(SIGFPE);
+      XX(SIGILL);
+      XX(SIGABRT);
+#undef XX
+      default:
+        return "UNKNOW";
+    }
+  }
+
+  static void RestoreCrashActions() {
+    for(size_t i = 0; i < s_crash_signal_count; ++i) {
+      sigaction(s_crash_signals[i], &s_crashOldActions[i], nullptr);
+    }
+  }
+
+  static void CrashSignalHandler(int sig, siginfo_t* info, void* ctx) {
+    //GetThreadId may register an atfork handler on first use
+    pid_t tid = syscall(SYS_gettid);
+    pid_t expected = 0;
+    if(!s_crashThread.compare_exchange_strong(expected, tid)) {
+      if(expected == tid) {
+        //faulted while reporting, die with what we have
+        RestoreCrashActions();
+        raise(sig);
+        return;
+      }
+      //another thread is reporting, the process ends with its signal
+      while(true) {
+        pause();
+      }
+    }
+
+    void* frames[s_crash_max_frames];
+    int n = backtrace(frames, s_crash_max_frames);
+
+    LogCrashLine line;
+    line.append("*** ");
+    line.append(CrashSignalName(sig));
+    line.append(" (signal ");
+    line.appendNumber(sig);
+    line.append(")");
+    if(sig == SIGSEGV || sig == SIGBUS) {
+      line.append(" addr 0x");
+      line.appendNumber((uintptr_t)info->si_addr, 16);
+    }
+    line.append(" thread ");
+    line.appendNumber(tid);
+    line.append(" ");
+    line.append(Thread::GetNameById(Thread::GetNameId()).c_str());
+    line.append(" fiber ");
+    line.appendNumber(GetFiberId());
+    line.append(" ***\n");
+
+    //buffered lines first, the report goes after them in every file
+    LogCrash::DrainFile(stdout);
+    int fds[LogCrash::MAX_SLOTS + 1];
+    size_t nfds = 0;
+    for(auto& i : s_crashSlots) {
+      LogCrash::FlushFunc func = i.func.load(std::memory_order_acquire);
+      if(func) {
+        int fd = func(i.arg.load(std::memory_order_relaxed));
+        if(fd >= 0) {
+          fds[nfds++] = fd;
+        }
+      }
+    }
+    fds[nfds++] = STDERR_FILENO;
+
+    for(size_t i = 0; i < nfds; ++i) {
+      line.writeTo(fds[i]);
+      backtrace_symbols_fd(frames, n, fds[i]);
+    }
+
+    //a fault happens again once we return, a sent signal has to be raised
+    RestoreCrashActions();
+    if(info->si_code <= 0) {
+      raise(sig);
+    }
+  }
+
+  void LogCrash::Install() {
+    if(s_crashInstalled.exchange(true)) {
+      return;
+    }
+    //backtrace loads libgcc on first use, which allocates
+    void* frames[1];
+    backtrace(frames, 1);
+    InstallAltStack();
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = CrashSignalHandler;
+    sa.sa_flags = SA_SIGINFO | SA_ONSTACK;
+    sigemptyset(&sa.sa_mask);
+    for(size_t i = 0; i < s_crash_signal_count; ++i) {
+      sigaction(s_crash_signals[i], &sa, &s_crashOldActions[i]);
+    }
+  }
+
+  void LogCrash::InstallAltStack() {
+    if(t_crashAltStack.stack) {
+      return;
+    }
+    stack_t ss;
+    //keep a stack someone else installed
+    if(sigaltstack(nullptr, &ss) == 0 && !(ss.ss_flags & SS_DISABLE)) {
+      return;
+    }
+    void* stack = malloc(s_crash_stack_size);
+    memset(&ss, 0, sizeof(ss));
+    ss.ss_sp = stack;
+    ss.ss_size = s_crash_stack_size;
+    if(sigaltstack(&ss, nullptr) != 0) {
+      std::cout << "LogCrash sigaltstack failed: " << strerror(errno) << std::endl;
+      free(stack);
+      return;
+    }
+    t_crashAltStack.stack = stack;
+  }
+
+  int LogCrash::Register(FlushFunc func, void* arg) {
+    std::lock_guard<std::mutex> lock(s_crashSlotMutex);
+    for(size_t i = 0; i < MAX_SLOTS; ++i) {
+      if(!s_crashSlots[i].func.load(std::memory_order_relaxed)) {
+        s_crashSlots[i].arg.store(arg, std::memory_order_relaxed);
+        s_crashSlots[i].func.store(func, std::memory_order_release);
+        return i;
+      }
+    }
+    std::cout << "LogCrash no free slot, " << MAX_SLOTS << " in use" << std::endl;
+    return -1;
+  }
+
+  void LogCrash::Unregister(int slot) {
+    if(slot < 0 || slot >= (int)MAX_SLOTS) {
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(s_crashSlotMutex);
+      s_crashSlots[slot].func.store(nullptr);
+    }
+    //the handler may still be inside the callback, the owner must stay alive
+    while(s_crashThread.load()) {
+      pause();
+    }
+  }
+
+  void LogCrash::DrainFile(FILE* file) {
+#ifdef __GLIBC__
+    if(file && file->_IO_write_ptr > file->_IO_write_base) {
+      CrashWriteAll(file->_fileno, file->_IO_write_base, file->_IO_write_ptr - file->_IO_write_base);
+      file->_IO_write_ptr = file->_IO_write_base;
+    }
+#endif
+  }
+
+  void LogCrash::Abort() {
+    sLOGPIPELINE::GetInstance()->flush();
+    abort();
+  }
+
+  //default batch bounds of StdoutLogAppender and FileLogAppender
+  static const size_t s_log_batch_size = 64 * 1024;
+  static const uint32_t s_log_batch_delay = 100;
+
+  struct LogFdWriterRegistry {
+    std::mutex              mutex;
+    std::set<LogFdWriter*>  writers;
+  };
+
+  static LogFdWriterRegistry& GetLogFdWriterRegistry() {
+    //leaked, writers of leaked loggers flush after static destruction
+    static LogFdWriterRegistry* s_registry = new LogFdWriterRegistry;
+    return *s_registry;
+  }
+
+  //batches still queued when the process exits normally
+  static void FlushLogFdWriters() {
+    auto& registry = GetLogFdWriterRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    for(auto i : registry.writers) {
+      i->flush();
+    }
+  }
+
+  static int s_log_fd_writer_atexit = atexit(FlushLogFdWriters);
+
+  LogFdWriter::LogFdWriter(int fd)
+    :m_fd(fd) {
+    auto& registry = GetLogFdWriterRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    registry.writers.insert(this);
+  }
+
+  LogFdWriter::~LogFdWriter() {
+    {
+      auto& registry = GetLogFdWriterRegistry();
+      std::lock_guard<std::mutex> lock(registry.mutex);
+      registry.writers.erase(this);
+    }
+    if(m_timerId) {
+      sLOGHOUSEKEEPER::GetInstance()->delTimer(m_timerId);
+    }
+    flush();
+  }
+
+  int LogFdWriter::setFd(int fd) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    flushLocked();
+    int old = m_fd;
+    m_fd = fd;
+    return old;
+  }
+
+  void LogFdWriter::setBatch(size_t max_bytes, uint32_t max_delay_ms) {
+    max_delay_ms = max_delay_ms ? max_delay_ms : 1;
+    uint64_t old_timer;
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if(max_bytes == m_maxBytes && max_delay_ms == m_maxDelay) {
+        return;
+      }
+      flushLocked();
+      m_maxBytes = max_bytes;
+      m_maxDelay = max_delay_ms;
+      old_timer = m_timerId;
+      m_timerId = 0;
+      if(m_maxBytes) {
+        m_timerId = sLOGHOUSEKEEPER::GetInstance()->addTimer(m_maxDelay, [this]() {
+          std::lock_guard<std::mutex> lock(m_mutex);
+          flushLocked();
+          return true;
+        });
+      }
+    }
+    //delTimer waits for a running callback, which takes m_mutex
+    if(old_timer) {
+      sLOGHOUSEKEEPER::GetInstance()->delTimer(old_timer);
+    }
+  }
+
+  bool LogFdWriter::append(const char* data, size_t len) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if(!m_maxBytes || (!m_bytes && len >= m_maxBytes)) {
+      //nothing to batch with, skip the copy
+      struct iovec iov;
+      iov.iov_base = const_cast<char*>(data);
+      iov.iov_len = len;
+      return WriteAll(m_fd, &iov, 1);
+    }
+
+    if(!m_used || m_chunks[m_used - 1].size() + len > CHUNK_SIZE) {
+      if(m_used == m_chunks.size()) {
+        m_chunks.emplace_back();
+        m_chunks.back().reserve(CHUNK_SIZE);
+      }
+      ++m_used;
+    }
+    m_chunks[m_used - 1].append(data, len);
+    m_bytes += len;
+    if(m_bytes >= m_maxBytes) {
+      return flushLocked();
+    }
+    return true;
+  }
+
+  bool LogFdWriter::write(struct iovec* iov, int count) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return flushLocked(iov, count);
+  }
+
+  bool LogFdWriter::flush() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return flushLocked();
+  }
+
+  bool LogFdWriter::flushLocked(struct iovec* iov, int count) {
+    if(!m_bytes && !count) {
+      return true;
+    }
+    m_iov.clear();
+    for(size_t i = 0; i < m_used; ++i) {
+      struct iovec v;
+      v.iov_base = &m_chunks[i][0];
+      v.iov_len = m_chunks[i].size();
+      m_iov.push_back(v);
+    }
+    m_iov.insert(m_iov.end(), iov, iov + count);
+    bool rt = WriteAll(m_fd, m_iov.data(), m_iov.size());
+
+    for(size_t i = 0; i < m_used; ++i) {
+      //a record larger than a chunk grew it, give the memory back
+      if(m_chunks[i].capacity() > CHUNK_SIZE) {
+        std::string().swap(m_chunks[i]);
+        m_chunks[i].reserve(CHUNK_SIZE);
+      }
+      m_chunks[i].clear();
+    }
+    m_used = 0;
+    m_bytes = 0;
+    return rt;
+  }
+
+  int LogFdWriter::emergencyFlush() {
+    if(CrashTryLock(m_mutex)) {
+      for(size_t i = 0; i < m_used; ++i) {
+        CrashWriteAll(m_fd, m_chunks[i].data(), m_chunks[i].size());
+      }
+    }
+    return m_fd;
+  }
+
+  bool LogFdWriter::WriteAll(int fd, struct iovec* iov, int count) {
+    while(count > 0) {
+      ssize_t n = writev(fd, iov, std::min(count, IOV_MAX));
+      if(n < 0) {
+        if(errno == EINTR) {
+          continue;
+        }
+        if(errno == EAGAIN) {
+          //someone else made the descriptor non-blocking, e.g. a shared stdout
+          struct pollfd pfd;
+          pfd.fd = fd;
+          pfd.events = POLLOUT;
+          poll(&pfd, 1, 100);
+          continue;
+        }
+        return false;
+      }
+      //resume a partial write where the kernel stopped
+      while(count > 0 && (size_t)n >= iov->iov_len) {
+        n -= iov->iov_len;
+        ++iov;
+        --count;
+      }
+      if(count > 0) {
+        iov->iov_base = static_cast<char*>(iov->iov_base) + n;
+        iov->iov_len -= n;
+      }
+    }
+    return true;
+  }
+
+  /**
+   * @brief gzip path into path.gz and remove path
+   */
+  static bool CompressFile(const std::string& path) {
+    std::string gz = path + ".gz";
+    FILE* in = fopen(path.c_str(), "rb");
+    if(!in) {
+      return false;
+    }
+    gzFile out = gzopen(gz.c_str(), "wb");
+    if(!out) {
+      fclose(in);
+      return false;
+    }
+
+    bool ok = true;
+    char buf[64 * 1024];
+    size_t n;
+    while((n = fread(buf, 1, sizeof(buf), in)) > 0) {
+      if(gzwrite(out, buf, n) != (int)n) {
+        ok = false;
+        break;
+      }
+    }
+    fclose(in);
+    if(gzclose(out) != Z_OK) {
+      ok = false;
+    }
+    unlink(ok ? path.c_str() : gz.c_str());
+    return ok;
+  }
+
+  /**
+   * @brief keep the newest max_files rotated files of filename
+   */
+  static void PruneRotated(const std::string& filename, uint32_t max_files) {
+    size_t pos = filename.rfind('/');
+    std::string dir = pos == std::string::npos ? "." : (pos == 0 ? "/" : filename.substr(0, pos));
+    std::string prefix = (pos == std::string::npos ? filename : filename.substr(pos + 1)) + ".";
+
+    DIR* d = opendir(dir.c_str());
+    if(!d) {
+      return;
+    }
+    std::vector<std::string> files;
+    struct dirent* ent;
+    while((ent = readdir(d)) != nullptr) {
+      std::string name = ent->d_name;
+      //rotated names are prefix + YYYYmmdd-HHMMSS, so they sort by age
+      if(name.size() > prefix.size() && name.compare(0, prefix.size(), prefix) == 0
+          && isdigit(name[prefix.size()])) {
+        files.push_back(name);
+      }
+    }
+    closedir(d);
+
+    if(files.size() <= max_files) {
+      return;
+    }
+    std::sort(files.begin(), files.end());
+    for(size_t i = 0; i < files.size() - max_files; ++i) {
+      unlink((dir + "/" + files[i]).c_str());
+    }
+  }
+
+  FileLogAppender::FileLogAppender(const std::string& filename)
+    :m_filename(filename) {
+      reopen();
+      m_writer.setBatch(s_log_batch_size, s_log_batch_delay);
+      m_crashSlot = LogCrash::Register(&FileLogAppender::EmergencyFlush, this);
+      m_watchId = sLOGHOUSEKEEPER::GetInstance()->addTimer(1000, [this]() {
+        checkFile();
+        return true;
+      });
+  }
+
+  FileLogAppender::~FileLogAppender() {
+    LogCrash::Unregister(m_crashSlot);
+    sLOGHOUSEKEEPER::GetInstance()->delTimer(m_watchId);
+    setAsync(false);
+    int fd = m_writer.setFd(-1);
+    if(fd >= 0) {
+      close(fd);
+    }
+  }
+
+  int FileLogAppender::EmergencyFlush(void* arg) {
+    FileLogAppender* self = static_cast<FileLogAppender*>(arg);
+    //oldest first: the writer batch, then the async buffers
+    int fd = self->m_writer.emergencyFlush();
+    if(fd < 0) {
+      return -1;
+    }
+    if(self->m_async) {
+      if(CrashTryLock(self->m_bufMutex)) {
+        for(auto& i : self->m_pending) {
+          CrashWriteAll(fd, i.data(), i.size());
+        }
+        CrashWriteAll(fd, self->m_front.data(), self->m_front.size());
+      }
+    }
+    return fd;
+  }
+
+  void FileLogAppender::setRotation(uint64_t max_size, uint32_t interval_sec, uint32_t max_files, bool compress) {
+    MUTEXTYPE::Lock lock(m_mutex);
+    m_maxSize = max_size;
+    m_rotateInterval = interval_sec;
+    m_maxFiles = max_files;
+    m_compress = compress;
+    if(m_rotateInterval) {
+      m_nextRotate = nextRotateTime(time(0));
+    }
+  }
+
+  uint64_t FileLogAppender::nextRotateTime(uint64_t now) const {
+    //align to local time, daily rotation happens at local midnight
+    struct tm tm;
+    time_t t = now;
+    localtime_r(&t, &tm);
+    int64_t local = now + tm.tm_gmtoff;
+    return (local / m_rotateInterval + 1) * m_rotateInterval - tm.tm_gmtoff;
+  }
+
+  void FileLogAppender::checkFile() {
+    struct stat st;
+    if(stat(m_filename.c_str(), &st) != 0
+        || (uint64_t)st.st_ino != m_ino
+        || (uint64_t)st.st_dev != m_dev) {
+      m_reopenPending = true;
+    }
+  }
+
+  bool FileLogAppender::needPrepareLocked(size_t len) const {
+    if(m_reopenPending) {
+      return true;
+    }
+    if(m_maxSize && m_fileSize && m_fileSize + len > m_maxSize) {
+      return true;
+    }
+    return m_rotateInterval && (uint64_t)time(0) >= m_nextRotate;
+  }
+
+  void FileLogAppender::prepareLocked(size_t len) {
+    if(m_reopenPending.exchange(false)) {
+      reopenLocked();
+    }
+    if(m_maxSize || m_rotateInterval) {
+      uint64_t now = m_rotateInterval ? time(0) : 0;
+      bool by_size = m_maxSize && m_fileSize && m_fileSize + len > m_maxSize;
+      bool by_time = m_rotateInterval && now >= m_nextRotate;
+      if(by_size || by_time) {
+        rotateLocked(now ? now : time(0));
+      }
+    }
+  }
+
+  void FileLogAppender::writeLocked(const char* data, size_t len) {
+    prepareLocked(len);
+    if(!m_writer.append(data, len)) {
+      std::cout << "FileLogAppender write " << m_filename << " failed: " << strerror(errno) << std::endl;
+    }
+    m_fileSize += len;
+  }
+
+  void FileLogAppender::rotateLocked(uint64_t now) {
+    //queued lines belong to the file being moved aside, reopenLocked writes them
+    struct tm tm;
+    time_t t = now;
+    localtime_r(&t, &tm);
+    char suffix[32];
+    strftime(suffix, sizeof(suffix), ".%Y%m%d-%H%M%S", &tm);
+    std::string target = m_filename + suffix;
+    //more than one rotation within a second
+    for(int i = 1; access(target.c_str(), F_OK) == 0
+        || access((target + ".gz").c_str(), F_OK) == 0; ++i) {
+      target = m_filename + suffix + "." + std::to_string(i);
+    }
+
+    if(rename(m_filename.c_str(), target.c_str()) != 0) {
+      std::cout << "FileLogAppender rotate " << m_filename << " to " << target << " failed" << std::endl;
+    }
+    reopenLocked();
+    if(m_rotateInterval) {
+      m_nextRotate = nextRotateTime(now);
+    }
+
+    if(m_compress || m_maxFiles) {
+      std::string filename = m_filename;
+      uint32_t max_files = m_maxFiles;
+      bool compress = m_compress;
+      sLOGHOUSEKEEPER::GetInstance()->post([filename, target, max_files, compress]() {
+        if(compress) {
+          CompressFile(target);
+        }
+        if(max_files) {
+          PruneRotated(filename, max_files);
+        }
+      });
+    }
+  }
+
+  void FileLogAppender::setAsync(bool val, uint32_t flush_interval_ms, uint64_t high_water) {
+    std::unique_lock<std::mutex> lock(m_bufMutex);
+    m_flushInterval = flush_interval_ms ? flush_interval_ms : 1;
+    m_highWater = high_water;
+    if(val == m_running) {
+      return;
+    }
+
+    if(val) {
+      m_front.reserve(s_async_buffer_size);
+      m_spares.resize(2);
+      for(auto& i : m_spares) {
+        i.reserve(s_async_buffer_size);
+      }
+      m_running = true;
+      m_async = true;
+      m_flusher = std::thread(&FileLogAppender::flushLoop, this);
+    }else {
+      //new lines go to the file directly, the flusher drains what is left
+      m_async = false;
+      m_running = false;
+      m_bufCond.notify_one();
+      lock.unlock();
+      m_flusher.join();
+
+      //lines appended while the flusher was exiting
+      lock.lock();
+      std::vector<std::string> rest;
+      if(!m_front.empty()) {
+        rest.push_back(std::move(m_front));
+      }
+      lock.unlock();
+      writeBuffers(rest);
+    }
+  }
+
+  void FileLogAppender::appendAsync(const char* data, size_t len) {
+    bool wake = false;
+    {
+      std::lock_guard<std::mutex> lock(m_bufMutex);
+      if(!m_front.empty() && m_front.size() + len > m_front.capacity()) {
+        if(m_pending.size() >= s_async_max_pending) {
+          ++m_dropped;
+          return;
+        }
+        m_pending.push_back(std::move(m_front));
+        if(!m_spares.empty()) {
+          m_front = std::move(m_spares.back());
+          m_spares.pop_back();
+        }else {
+          m_front = std::string();
+          m_front.reserve(s_async_buffer_size);
+        }
+        wake = true;
+      }
+      m_front.append(data, len);
+      m_pendingBytes += len;
+      if(m_pendingBytes >= m_highWater) {
+        wake = true;
+      }
+    }
+    if(wake) {
+      m_bufCond.notify_one();
+    }
+  }
+
+  void FileLogAppender::flushLoop() {
+    std::vector<std::string> bufs;
+    bool running = true;
+    while(running) {
+      {
+        std::unique_lock<std::mutex> lock(m_bufMutex);
+        if(m_running && m_pending.empty() && m_pendingBytes < m_highWater) {
+          m_bufCond.wait_for(lock, std::chrono::milliseconds(m_flushInterval));
+        }
+        if(!m_front.empty()) {
+          m_pending.push_back(std::move(m_front));
+          if(!m_spares.empty()) {
+            m_front = std::move(m_spares.back());
+            m_spares.pop_back();
+          }else {
+            m_front = std::string();
+            m_front.reserve(s_async_buffer_size);
+          }
+        }
+        bufs.swap(m_pending);
+        m_pendingBytes = 0;
+        running = m_running;
+      }
+
+      writeBuffers(bufs);
+
+      {
+        std::lock_guard<std::mutex> lock(m_bufMutex);
+        for(auto& i : bufs) {
+          if(m_spares.size() >= 2) {
+            break;
+          }
+          i.clear();
+          m_spares.push_back(std::move(i));
+        }
+      }
+      bufs.clear();
+    }
+  }
+
+  void FileLogAppender::writeBuffers(std::vector<std::string>& bufs) {
+    MUTEXTYPE::Lock lock(m_mutex);
+    uint64_t dropped = m_dropped.exchange(0);
+    if(dropped) {
+      std::string msg = "FileLogAppender dropped " + std::to_string(dropped) + " lines\n";
+      writeLocked(msg.data(), msg.size());
+    }
+
+    //consecutive buffers leave in one writev, split where the file changes
+    std::vector<struct iovec> iov;
+    iov.reserve(bufs.size());
+    auto write_gathered = [this, &iov]() {
+      if(!iov.empty() && !m_writer.write(iov.data(), iov.size())) {
+        std::cout << "FileLogAppender write " << m_filename << " failed: " << strerror(errno) << std::endl;
+      }
+      iov.clear();
+    };
+    for(auto& i : bufs) {
+      if(needPrepareLocked(i.size())) {
+        write_gathered();
+        prepareLocked(i.size());
+      }
+      struct iovec v;
+      v.iov_base = &i[0];
+      v.iov_len = i.size();
+      iov.push_back(v);
+      m_fileSize += i.size();
+    }
+    write_gathered();
+    m_writer.flush();
+  }
+
+  void FileLogAppender::log(Logger* logger, LogLevel::Level level, const LogEvent::spLE& event) {
+    if(level >= getLevel()) {
+      if(m_async) {
+        const LogStream* buf;
+        {
+          MUTEXTYPE::Lock lock(m_mutex);
+          buf = &render(logger, level, *event);
+        }
+        appendAsync(buf->data(), buf->size());
+        return;
+      }
+
+      MUTEXTYPE::Lock lock(m_mutex);
+      const LogStream& buf = render(logger, level, *event);
+      writeLocked(buf.data(), buf.size());
+    }
+  }
+
+  std::string FileLogAppender::toYamlString() {
+    MUTEXTYPE::Lock lock(m_mutex);
+    YAML::Node node;
+    node["type"] = "FileLogAppender";
+    node["file"] = m_filename;
+    if(m_async) {
+      node["async"] = true;
+      node["flush_interval"] = m_flushInterval;
+      node["high_water"] = m_highWater;
+    }
+    if(m_maxSize) {
+      node["max_size"] = m_maxSize;
+    }
+    if(m_rotateInterval) {
+      node["rotate_interval"] = m_rotateInterval;
+    }
+    if(m_maxFiles) {
+      node["max_files"] = m_maxFiles;
+    }
+    if(m_compress) {
+      node["compress"] = true;
+    }
+    node["batch_size"] = m_writer.getBatchSize();
+    node["batch_delay"] = m_writer.getBatchDelay();
+    if(m_level != LogLevel::UNKONWN){
+      node["level"] = LogLevel::ToString(m_level);
+    }
+    if(m_hasFormatter && m_formatter){
+      node["formatter"] = m_formatter->getPattern();
+    }
+    std::stringstream ss;
+    ss << node;
+    return ss.str();
+  }
+
+  bool FileLogAppender::reopen() {
+    MUTEXTYPE::Lock lock(m_mutex);
+    return reopenLocked();
+  }
+
+  /**
+   * @brief create the missing directories of path
+   */
+  static bool MakeParentDirs(const std::string& path) {
+    for(size_t pos = path.find('/', 1); pos != std::string::npos; pos = path.find('/', pos + 1)) {
+      if(mkdir(path.substr(0, pos).c_str(), 0755) != 0 && errno != EEXIST) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  bool FileLogAppender::reopenLocked() {
+    int fd = open(m_filename.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if(fd < 0 && errno == ENOENT && MakeParentDirs(m_filename)) {
+      fd = open(m_filename.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    }
+    if(fd < 0) {
+      std::cout << "FileLogAppender open " << m_filename << " failed: " << strerror(errno) << std::endl;
+    }
+
+    //the batch goes to the old file before the switch
+    int old = m_writer.setFd(fd);
+    if(old >= 0) {
+      close(old);
+    }
+    struct stat st;
+    if(fd >= 0 && fstat(fd, &st) == 0) {
+      m_dev = st.st_dev;
+      m_ino = st.st_ino;
+      m_fileSize = st.st_size;
+    }
+    return fd >= 0;
+  }
+
+  StdoutLogAppender::StdoutLogAppender()
+    :m_writer(STDOUT_FILENO) {
+    m_writer.setBatch(s_log_batch_size, s_log_batch_delay);
+    m_crashSlot = LogCrash::Register(&StdoutLogAppender::EmergencyFlush, this);
+  }
+
+  StdoutLogAppender::~StdoutLogAppender() {
+    LogCrash::Unregister(m_crashSlot);
+  }
+
+  int StdoutLogAppender::EmergencyFlush(void* arg) {
+    //the report goes to stderr anyway
+    static_cast<StdoutLogAppender*>(arg)->m_writer.emergencyFlush();
+    return -1;
+  }
+
+  void StdoutLogAppender::log(Logger* logger, LogLevel::Level level, const LogEvent::spLE& event) {
+    if(level >= getLevel()){
+      const LogStream* buf;
+      {
+        MUTEXTYPE::Lock lock(m_mutex);
+        buf = &render(logger, level, *event);
+      }
+      //the render buffer belongs to this thread, the writer has its own lock
+      m_writer.append(buf->data(), buf->size());
+    }
+  }
+
+  std::string StdoutLogAppender::toYamlString() {
+    MUTEXTYPE::Lock lock(m_mutex);
+    YAML::Node node;
+    node["type"] = "StdoutLogAppender";
+    node["batch_size"] = m_writer.getBatchSize();
+    node["batch_delay"] = m_writer.getBatchDelay();
+    if(m_level != LogLevel::UNKONWN) {
+      node["level"] = LogLevel::ToString(m_level);
+    }
+    if(m_hasFormatter && m_formatter) {
+      node["formatter"] = m_formatter->getPattern();
+    }
+    std::stringstream ss;
+    ss << node;
+    return ss.str();
+  }
+
+  LogRing::LogRing(size_t capacity) {
+    size_t n = 2;
+    while(n < capacity) {
+      n <<= 1;
+    }
+    m_slots.resize(n);
+    m_mask = n - 1;
+  }
+
+  bool LogRing::push(Record&& r) {
+    size_t tail = m_tail.load(std::memory_order_relaxed);
+    if(tail - m_head.load(std::memory_order_acquire) > m_mask) {
+      return false;
+    }
+    m_slots[tail & m_mask] = std::move(r);
+    m_tail.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool LogRing::pop(Record& r) {
+    MUTEXTYPE::Lock lock(m_popMutex);
+    size_t head = m_head.load(std::memory_order_relaxed);
+    if(head == m_tail.load(std::memory_order_acquire)) {
+      return false;
+    }
+    r = std::move(m_slots[head & m_mask]);
+    m_head.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool LogRing::empty() const {
+    return m_head.load(std::memory_order_acquire) == m_tail.load(std::memory_order_acquire);
+  }
+
+  bool LogRing::full() const {
+    return m_tail.load(std::memory_order_acquire) - m_head.load(std::memory_order_acquire) > m_mask;
+  }
+
+  //records taken from one ring per drain round
+  static const size_t s_pipeline_drain_batch = 256;
+
+  struct LogRingHolder {
+    LogRing::spLR ring;
+    ~LogRingHolder() {
+      if(ring) {
+        ring->close();
+      }
+    }
+  };
+
+  static thread_local LogRingHolder t_logRing;
+  static thread_local bool t_isPipelineBackend = false;
+
+  LogPipeline::LogPipeline() {}
+
+  LogPipeline::~LogPipeline() {
+    stop();
+  }
+
+  void LogPipeline::start() {
+    MUTEXTYPE::Lock lock(m_mutex);
+    if(m_running) {
+      return;
+    }
+    m_running = true;
+    m_thread = std::thread(&LogPipeline::run, this);
+  }
+
+  void LogPipeline::flush() {
+    //called by an appender on the backend, which is in drain() already
+    if(t_isPipelineBackend) {
+      return;
+    }
+    //records our appenders log meanwhile are dispatched at once, not queued
+    t_isPipelineBackend = true;
+    while(drain());
+    t_isPipelineBackend = false;
+  }
+
+  void LogPipeline::stop() {
+    {
+      MUTEXTYPE::Lock lock(m_mutex);
+      if(!m_running) {
+        return;
+      }
+      m_running = false;
+    }
+    m_sleepCond.notify_one();
+    {
+      std::lock_guard<std::mutex> lock(m_spaceMutex);
+      m_spaceCond.notify_all();
+    }
+    m_thread.join();
+    //records pushed by threads which raced with the backend exit
+    while(drain());
+  }
+
+  LogRing* LogPipeline::getThreadRing() {
+    if(!t_logRing.ring) {
+      t_logRing.ring = std::make_shared<LogRing>(m_capacity);
+      MUTEXTYPE::Lock lock(m_mutex);
+      m_rings.push_back(t_logRing.ring);
+    }
+    return t_logRing.ring.get();
+  }
+
+  bool LogPipeline::enqueue(Logger::spLOGGER logger, LogLevel::Level level, LogEvent::spLE event) {
+    //appenders which log from the backend must not wait on themselves
+    if(!isRunning() || t_isPipelineBackend) {
+      return false;
+    }
+
+    LogRing* ring = getThreadRing();
+    LogRing::Record r;
+    //creation time, so records merge in the order they were logged
+    r.ts = event->getElapse();
+    r.logger = std::move(logger);
+    r.level = level;
+    r.event = std::move(event);
+
+    while(!ring->push(std::move(r))) {
+      switch(m_policy.load(std::memory_order_relaxed)) {
+        case DROP_NEWEST:
+          ++m_dropped;
+          return true;
+        case DROP_OLDEST: {
+          LogRing::Record old;
+          if(ring->pop(old)) {
+            ++m_dropped;
+          }
+          break;
+        }
+        default: {
+          if(!isRunning()) {
+            return false;
+          }
+          //park until drain() makes room, the timeout covers a missed wakeup
+          m_blocked.fetch_add(1);
+          m_sleepCond.notify_one();
+          {
+            std::unique_lock<std::mutex> lock(m_spaceMutex);
+            m_spaceCond.wait_for(lock, std::chrono::milliseconds(10), [this, ring]() {
+              return !ring->full() || !isRunning();
+            });
+          }
+          m_blocked.fetch_sub(1);
+          break;
+        }
+      }
+    }
+
+    if(m_sleeping.load(std::memory_order_relaxed)) {
+      m_sleepCond.notify_one();
+    }
+    return true;
+  }
+
+  size_t LogPipeline::drain() {
+    //flush() may drain beside the backend, one merge at a time keeps the order
+    std::lock_guard<std::mutex> drain_lock(m_drainMutex);
+    std::vector<LogRing::spLR> rings;
+    {
+      MUTEXTYPE::Lock lock(m_mutex);
+      rings = m_rings;
+    }
+
+    std::vector<std::vector<LogRing::Record>> staged(rings.size());
+    size_t total = 0;
+    for(size_t i = 0; i < rings.size(); ++i) {
+      LogRing::Record r;
+      while(staged[i].size() < s_pipeline_drain_batch && rings[i]->pop(r)) {
+        staged[i].push_back(std::move(r));
+      }
+      total += staged[i].size();
+    }
+
+    //each ring is already ordered, merge them by timestamp
+    std::vector<size_t> pos(rings.size(), 0);
+    for(size_t n = 0; n < total; ++n) {
+      size_t min = rings.size();
+      for(size_t i = 0; i < rings.size(); ++i) {
+        if(pos[i] < staged[i].size()
+            && (min == rings.size() || staged[i][pos[i]].ts < staged[min][pos[min]].ts)) {
+          min = i;
+        }
+      }
+      auto& r = staged[min][pos[min]++];
+      r.logger->dispatch(r.level, r.event);
+    }
+
+    if(total && m_blocked.load()) {
+      std::lock_guard<std::mutex> lock(m_spaceMutex);
+      m_spaceCond.notify_all();
+    }
+
+    bool has_closed = false;
+    for(auto& i : rings) {
+      if(i->isClosed() && i->empty()) {
+        has_closed = true;
+        break;
+      }
+    }
+    if(has_closed) {
+      MUTEXTYPE::Lock lock(m_mutex);
+      for(auto it = m_rings.begin(); it != m_rings.end();) {
+        if((*it)->isClosed() && (*it)->empty()) {
+          it = m_rings.erase(it);
+        }else {
+          ++it;
+        }
+      }
+    }
+    return total;
+  }
+
+  void LogPipeline::run() {
+    t_isPipelineBackend = true;
+    int idle = 0;
+    while(true) {
+      if(drain()) {
+        idle = 0;
+        continue;
+      }
+      if(!m_running) {
+        break;
+      }
+      if(++idle < 64) {
+        std::this_thread::yield();
+        continue;
+      }
+      //producers only notify while we sleep, the timeout covers a missed wakeup
+      std::unique_lock<std::mutex> lock(m_sleepMutex);
+      m_sleeping = true;
+      m_sleepCond.wait_for(lock, std::chrono::milliseconds(10));
+      m_sleeping = false;
+    }
+  }
+
+  /**
+   * @brief return end of valid data, skipping zeros left by a crash
+   *        before unused preallocated space was cut off
+   */
+  static uint64_t FindDataEnd(int fd) {
+    struct stat st;
+    if(fstat(fd, &st) != 0) {
+      return 0;
+    }
+    uint64_t end = st.st_size;
+    char buf[64 * 1024];
+    while(end > 0) {
+      size_t n = std::min<uint64_t>(end, sizeof(buf));
+      if(pread(fd, buf, n, end - n) != (ssize_t)n) {
+        break;
+      }
+      size_t i = n;
+      while(i > 0 && buf[i - 1] == '\0') {
+        --i;
+      }
+      if(i > 0) {
+        return end - n + i;
+      }
+      end -= n;
+    }
+    return end;
+  }
+
+  MmapFileLogAppender::MmapFileLogAppender(const std::string& filename, size_t chunk_size
+                      ,uint32_t sync_interval_ms)
+    :m_filename(filename)
+    ,m_chunkSize(chunk_size)
+    ,m_syncInterval(sync_interval_ms) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    m_chunkSize = std::max(page, (m_chunkSize + page - 1) / page * page);
+
+    m_fd = open(m_filename.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if(m_fd < 0) {
+      std::cout << "MmapFileLogAppender open " << m_filename << " failed: " << strerror(errno) << std::endl;
+      return;
+    }
+    m_startPos = FindDataEnd(m_fd);
+    m_writePos = m_startPos;
+
+    if(m_syncInterval) {
+      m_syncId = sLOGHOUSEKEEPER::GetInstance()->addTimer(m_syncInterval, [this]() {
+        sync();
+        return true;
+      });
+    }
+  }
+
+  MmapFileLogAppender::~MmapFileLogAppender() {
+    if(m_syncId) {
+      sLOGHOUSEKEEPER::GetInstance()->delTimer(m_syncId);
+    }
+    if(m_fd < 0) {
+      return;
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(m_mapMutex);
+      for(auto& c : m_chunks) {
+        char* base = c.base.load(std::memory_order_relaxed);
+        if(c.index.load(std::memory_order_relaxed) != NO_CHUNK && base) {
+          munmap(base, m_chunkSize);
+        }
+        c.index.store(NO_CHUNK, std::memory_order_relaxed);
+      }
+    }
+    //drop the preallocated tail
+    if(ftruncate(m_fd, m_writePos) != 0) {
+      std::cout << "MmapFileLogAppender truncate " << m_filename << " failed: " << strerror(errno) << std::endl;
+    }
+    close(m_fd);
+  }
+
+  void MmapFileLogAppender::log(Logger* logger, LogLevel::Level level, const LogEvent::spLE& event) {
+    if(level >= getLevel() && m_fd >= 0) {
+      const LogStream* buf;
+      {
+        MUTEXTYPE::Lock lock(m_mutex);
+        buf = &render(logger, level, *event);
+      }
+      write(buf->data(), buf->size());
+    }
+  }
+
+  void MmapFileLogAppender::write(const char* data, size_t len) {
+    uint64_t pos = m_writePos.fetch_add(len, std::memory_order_relaxed);
+    while(len) {
+      uint64_t index = pos / m_chunkSize;
+      size_t offset = pos % m_chunkSize;
+      size_t n = std::min(len, m_chunkSize - offset);
+      char* base = acquireChunk(index);
+      if(base) {
+        memcpy(base + offset, data, n);
+      }
+      //dropped bytes count as written too, or the slot is never freed
+      releaseChunk(index, n);
+      pos += n;
+      data += n;
+      len -= n;
+    }
+  }
+
+  char* MmapFileLogAppender::acquireChunk(uint64_t index) {
+    Chunk& c = m_chunks[index % CHUNK_SLOTS];
+    while(true) {
+      if(c.index.load(std::memory_order_acquire) == index) {
+        return c.base.load(std::memory_order_relaxed);
+      }
+
+      {
+        std::lock_guard<std::mutex> lock(m_mapMutex);
+        uint64_t cur = c.index.load(std::memory_order_relaxed);
+        if(cur == index) {
+          return c.base.load(std::memory_order_relaxed);
+        }
+        if(cur == NO_CHUNK) {
+          off_t offset = index * m_chunkSize;
+          char* base = nullptr;
+          //allocate blocks up front, stores into a hole can SIGBUS on a full disk;
+          //only a file system without fallocate falls back to a sparse extend
+          if(fallocate(m_fd, 0, offset, m_chunkSize) != 0) {
+            struct stat st;
+            if(errno != EOPNOTSUPP && errno != ENOSYS) {
+              std::cout << "MmapFileLogAppender allocate " << m_filename << " failed: " << strerror(errno)
+                        << ", chunk " << index << " dropped" << std::endl;
+            }else if(fstat(m_fd, &st) == 0 && (uint64_t)st.st_size < offset + m_chunkSize
+                && ftruncate(m_fd, offset + m_chunkSize) != 0) {
+              std::cout << "MmapFileLogAppender extend " << m_filename << " failed: " << strerror(errno)
+                        << ", chunk " << index << " dropped" << std::endl;
+            }else {
+              base = mapChunk(offset);
+            }
+          }else {
+            base = mapChunk(offset);
+          }
+
+          //bytes already in the file count as written; a chunk which could not
+          //be mapped stays in the slot with a null base until its bytes are
+          //dropped, so writers behind it are not held up
+          uint64_t begin = index * m_chunkSize;
+          c.written.store(m_startPos > begin ? std::min<uint64_t>(m_startPos - begin, m_chunkSize) : 0
+                          ,std::memory_order_relaxed);
+          c.base.store(base, std::memory_order_relaxed);
+          c.index.store(index, std::memory_order_release);
+          return base;
+        }
+      }
+      //slot still holds chunk index - CHUNK_SLOTS, wait for its last writers
+      std::this_thread::yield();
     }
-  };
-
-  LogEvent::LogEvent(std::shared_ptr<Logger> logger, LogLevel::Level level
-            ,const char* file, int32_t line, uint32_t elapse
-            ,uint32_t thread_id, uint32_t fiber_id, uint64_t time
-            ,const std::string& thread_name) 
-            : m_file(file)
-            ,m_line(line)
-            ,m_elapse(elapse)
-            ,m_threadId(thread_id)
-            ,m_fiberId(fiber_id)
-            ,m_time(time)
-            ,m_threadName(thread_name)
-            ,m_logger(logger)
-            ,m_level(level){
   }
 
-  Logger::Logger(const std::string& name)
-          : m_name(name)
-          , m_level(LogLevel::DEBUG){
-            m_formatter = std::make_shared<LogFormatter>("%d{%Y-%m-%d %H:%M:%S}%T%t%T%N%T%F%T[%p]%T[%c]%T%f:%l%T%m%n");
+  char* MmapFileLogAppender::mapChunk(off_t offset) {
+    void* p = mmap(nullptr, m_chunkSize, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, offset);
+    if(p == MAP_FAILED) {
+      std::cout << "MmapFileLogAppender mmap " << m_filename << " failed: " << strerror(errno) << std::endl;
+      return nullptr;
+    }
+    return static_cast<char*>(p);
   }
 
-  void Logger::setFormatter(LogFormatter::spLF val) {
-    MUTEXTYPE::Lock lock(m_mutex);
-    m_formatter = val;
-
-    //assign formatter for eveny appender
-    for(auto& i : m_appenders) {
-      MUTEXTYPE::Lock ll(i->m_mutex);
-      if(!i->m_hasFormatter) {
-        i->m_formatter = m_formatter;
+  void MmapFileLogAppender::releaseChunk(uint64_t index, size_t len) {
+    Chunk& c = m_chunks[index % CHUNK_SLOTS];
+    if(c.written.fetch_add(len, std::memory_order_acq_rel) + len == m_chunkSize) {
+      std::lock_guard<std::mutex> lock(m_mapMutex);
+      if(char* base = c.base.load(std::memory_order_relaxed)) {
+        munmap(base, m_chunkSize);
       }
+      c.base.store(nullptr, std::memory_order_relaxed);
+      c.written.store(0, std::memory_order_relaxed);
+      c.index.store(NO_CHUNK, std::memory_order_release);
     }
   }
 
-  void Logger::setFormatter(const std::string& val) {
-    std::cout << "---" << val << std::endl;
-    loongserver::LogFormatter::spLF new_val = std::make_shared<loongserver::LogFormatter>(val);
-    if(new_val->isError()){
-      std::cout << "Logger setFormatter name=" << m_name
-                << " value=" << val << " invalid formatter"
-                << std::endl;
-      return;
+  void MmapFileLogAppender::sync() {
+    std::lock_guard<std::mutex> lock(m_mapMutex);
+    for(auto& c : m_chunks) {
+      char* base = c.base.load(std::memory_order_relaxed);
+      if(c.index.load(std::memory_order_relaxed) != NO_CHUNK && base) {
+        msync(base, m_chunkSize, MS_ASYNC);
+      }
     }
-    setFormatter(new_val);
   }
 
-  std::string Logger::toYamlString() {
+  std::string MmapFileLogAppender::toYamlString() {
     MUTEXTYPE::Lock lock(m_mutex);
     YAML::Node node;
-    node["name"] = m_name;
+    node["type"] = "MmapFileLogAppender";
+    node["file"] = m_filename;
+    node["chunk_size"] = m_chunkSize;
+    node["sync_interval"] = m_syncInterval;
     if(m_level != LogLevel::UNKONWN) {
       node["level"] = LogLevel::ToString(m_level);
     }
-    if(m_formatter) {
+    if(m_hasFormatter && m_formatter) {
       node["formatter"] = m_formatter->getPattern();
     }
-
-    for(auto& i : m_appenders){
-      node["appenders"].push_back(YAML::Load(i->toYamlString()));
-    }
     std::stringstream ss;
     ss << node;
     return ss.str();
   }
 
-  LogFormatter::spLF Logger::getFormatter() {
-    MUTEXTYPE::Lock lock(m_mutex);
-    return m_formatter;
+  static std::atomic<uint64_t> s_formatter_id {0};
+
+  LogFormatter::LogFormatter(const std::string& pattern) 
+    :m_id(++s_formatter_id)
+    ,m_pattern(pattern){
+    init();
   }
 
-  void Logger::addAppender(LogAppender::spLA appender){
-    MUTEXTYPE::Lock lock(m_mutex);
-    if(!appender->getFormatter()){
-      MUTEXTYPE::Lock ll(appender->m_mutex);
-      appender->m_formatter = m_formatter;
+  LogFormatter::spLF LogFormatter::Create(const std::string& pattern) {
+    if(pattern == "json") {
+      return std::make_shared<JsonFormatter>();
     }
-    m_appenders.push_back(appender);
+    return std::make_shared<LogFormatter>(pattern);
   }
+  
+  //level names indexed by LogLevel::Level
+  static const struct {
+    const char* str;
+    size_t      len;
+  } s_level_names[] = {
+    {"UNKNOW", 6}, {"DEBUG", 5}, {"INFO", 4}, {"WARN", 4}, {"ERROR", 5}, {"FATAL", 5},
+  };
 
-  void Logger::delAppender(LogAppender::spLA appender) {
-    MUTEXTYPE::Lock lock(m_mutex);
-    for(auto it = m_appenders.begin(); it != m_appenders.end(); ++it){
-      if(*it == appender) {
-        m_appenders.erase(it);
-        break;
+  //thread local strftime results keyed on (format, epoch second)
+  struct DateTimeCacheEntry {
+    std::string fmt;
+    time_t      sec {-1};
+    size_t      len {0};
+    char        buf[64];
+  };
+
+  static thread_local DateTimeCacheEntry t_dateTimeCache[4];
+  static thread_local size_t t_dateTimeCacheNext = 0;
+
+  /**
+   * @brief render sec with strftime format fmt, only once per second
+   */
+  static void AppendDateTime(LogStream& buf, const char* fmt, size_t fmt_len, time_t sec) {
+    for(auto& e : t_dateTimeCache) {
+      if(e.sec == sec && e.fmt.size() == fmt_len
+          && memcmp(e.fmt.data(), fmt, fmt_len) == 0) {
+        buf.append(e.buf, e.len);
+        return;
       }
     }
-  }
-
-  void Logger::clearAppenders() {
-    MUTEXTYPE::Lock lock(m_mutex);
-    m_appenders.clear();
-  }
 
-  void Logger::log(LogLevel::Level level, LogEvent::spLE event) {
-    if(level >= m_level){
-      auto self = shared_from_this();
-      MUTEXTYPE::Lock lock(m_mutex);
-      if(!m_appenders.empty()){
-        for(auto& i : m_appenders)
-          i->log(self, level, event);
+    DateTimeCacheEntry* e = nullptr;
+    for(auto& i : t_dateTimeCache) {
+      if(i.fmt.size() == fmt_len && memcmp(i.fmt.data(), fmt, fmt_len) == 0) {
+        e = &i;
+        break;
       }
-    }else if(m_root){
-      m_root->log(level, event);
     }
-  }
+    if(!e) {
+      e = &t_dateTimeCache[t_dateTimeCacheNext++ % 4];
+      e->fmt.assign(fmt, fmt_len);
+    }
 
-  void Logger::debug(LogEvent::spLE event) {
-    log(LogLevel::DEBUG, event);
+    struct tm tm;
+    localtime_r(&sec, &tm);
+    e->sec = sec;
+    e->len = strftime(e->buf, sizeof(e->buf), e->fmt.c_str(), &tm);
+    buf.append(e->buf, e->len);
   }
 
-  void Logger::info(LogEvent::spLE event) {
-    log(LogLevel::INFO, event);
+  /**
+   * @brief append the leading digits of a six digit microsecond value
+   */
+  static void AppendSubSecond(LogStream& buf, uint32_t usec, uint32_t digits) {
+    char tmp[6];
+    for(int i = 5; i >= 0; --i) {
+      tmp[i] = '0' + usec % 10;
+      usec /= 10;
+    }
+    buf.append(tmp, digits);
   }
 
-  void Logger::warn(LogEvent::spLE event) {
-    log(LogLevel::WARN, event);
+  void LogFormatter::format(LogStream& buf, Logger* logger, LogLevel::Level level, const LogEvent& event) {
+    const char* literals = m_literals.data();
+    for(auto& op : m_program) {
+      switch(op.code) {
+        case OP_LITERAL:
+          buf.append(literals + op.arg, op.len);
+          break;
+        case OP_MESSAGE:
+          buf.append(event.getSS().data(), event.getSS().size());
+          break;
+        case OP_LEVEL: {
+          size_t idx = (level > LogLevel::UNKONWN && level <= LogLevel::FATAL) ? level : 0;
+          buf.append(s_level_names[idx].str, s_level_names[idx].len);
+          break;
+        }
+        case OP_LOGGER: {
+          const std::string& name = event.getLogger()->getName();
+          buf.append(name.data(), name.size());
+          break;
+        }
+        case OP_THREAD_ID:
+          buf.appendUInt(event.getThreadId());
+          break;
+        case OP_FIBER_ID:
+          buf.appendUInt(event.getFiberId());
+          break;
+        case OP_LINE:
+          buf.appendUInt(event.getLine());
+          break;
+        case OP_DATETIME:
+          AppendDateTime(buf, literals + op.arg, op.len, event.getTime());
+          break;
+        case OP_SUBSECOND:
+          AppendSubSecond(buf, event.getUsec(), op.arg);
+          break;
+        case OP_ITEM:
+          m_items[op.arg]->format(buf, logger, level, event);
+          break;
+      }
+    }
   }
 
-  void Logger::error(LogEvent::spLE event) {
-    log(LogLevel::ERROR, event);
+  std::string LogFormatter::format(const Logger::spLOGGER& logger, LogLevel::Level level, const LogEvent::spLE& event) {
+    LogStream& buf = t_formatBuffer;
+    buf.clear();
+    format(buf, logger.get(), level, *event);
+    return buf.str();
   }
 
-  void Logger::fatal(LogEvent::spLE event) {
-    log(LogLevel::FATAL, event);
+  std::ostream& LogFormatter::format(std::ostream& ofs, const Logger::spLOGGER& logger, LogLevel::Level level, const LogEvent::spLE& event) {
+    LogStream& buf = t_formatBuffer;
+    buf.clear();
+    format(buf, logger.get(), level, *event);
+    return ofs.write(buf.data(), buf.size());
   }
 
-  FileLogAppender::FileLogAppender(const std::string& filename)
-    :m_filename(filename) {
-      reopen();
+  static const char s_hex_digits[] = "0123456789abcdef";
+
+  /**
+   * @brief append string literal without counting its length by hand
+   */
+  template<size_t N>
+  static void AppendLiteral(LogStream& buf, const char (&str)[N]) {
+    buf.append(str, N - 1);
   }
 
-  void FileLogAppender::log(Logger::spLOGGER logger, LogLevel::Level level, LogEvent::spLE event) {
-    if(level >= m_level) {
-      uint64_t now = event->getTime();
-      if(now >= (m_lastTime + 3)) {
-        reopen();
-        m_lastTime = now;
+  /**
+   * @brief append str as a JSON string literal, quotes included
+   * @details runs of plain bytes are copied in one append, utf-8 passes through
+   */
+  static void AppendJsonString(LogStream& buf, const char* str, size_t len) {
+    AppendLiteral(buf, "\"");
+    size_t run = 0;
+    for(size_t i = 0; i < len; ++i) {
+      unsigned char c = str[i];
+      if(c >= 0x20 && c != '"' && c != '\\') {
+        continue;
       }
-
-      MUTEXTYPE::Lock lock(m_mutex);
-
-      if(!m_formatter->format(m_filestream, logger, level, event)){
-        std::cout << "error" << std::endl;
+      buf.append(str + run, i - run);
+      run = i + 1;
+      switch(c) {
+        case '"': AppendLiteral(buf, "\\\""); break;
+        case '\\': AppendLiteral(buf, "\\\\"); break;
+        case '\n': AppendLiteral(buf, "\\n"); break;
+        case '\r': AppendLiteral(buf, "\\r"); break;
+        case '\t': AppendLiteral(buf, "\\t"); break;
+        default: {
+          char esc[6] = {'\\', 'u', '0', '0', s_hex_digits[c >> 4], s_hex_digits[c & 0xf]};
+          buf.append(esc, sizeof(esc));
+          break;
+        }
       }
     }
+    buf.append(str + run, len - run);
+    AppendLiteral(buf, "\"");
   }
 
-  std::string FileLogAppender::toYamlString() {
-    MUTEXTYPE::Lock lock(m_mutex);
-    YAML::Node node;
-    node["type"] = "FileLogAppender";
-    node["file"] = m_filename;
-    if(m_level != LogLevel::UNKONWN){
-      node["level"] = LogLevel::ToString(m_level);
-    }
-    if(m_hasFormatter && m_formatter){
-      node["formatter"] = m_formatter->getPattern();
-    }
-    std::stringstream ss;
-    ss << node;
-    return ss.str();
+  static void AppendJsonKey(LogStream& buf, const char* key, size_t len) {
+    AppendLiteral(buf, ",");
+    AppendJsonString(buf, key, len);
+    AppendLiteral(buf, ":");
   }
 
-  bool FileLogAppender::reopen() {
-    MUTEXTYPE::Lock lock(m_mutex);
-    if(m_filestream) {
-      m_filestream.close();
+  static void AppendJsonDouble(LogStream& buf, double v) {
+    if(!std::isfinite(v)) {
+      AppendLiteral(buf, "null");
+      return;
     }
-    return FSUtil::OpenForWrite(m_filestream, m_filename, std::ios::app);
+    char tmp[32];
+    int len = snprintf(tmp, sizeof(tmp), "%.17g", v);
+    buf.append(tmp, len);
   }
 
-  void StdoutLogAppender::log(Logger::spLOGGER logger, LogLevel::Level level, LogEvent::spLE event) {
-    if(level >= m_level){
-      MUTEXTYPE::Lock lock(m_mutex);
-      m_formatter->format(std::cout, logger, level, event);
-    }
+  JsonFormatter::JsonFormatter()
+    :LogFormatter("json") {
   }
 
-  std::string StdoutLogAppender::toYamlString() {
-    MUTEXTYPE::Lock lock(m_mutex);
-    YAML::Node node;
-    node["type"] = "StdoutLogAppender";
-    if(m_level != LogLevel::UNKONWN) {
-      node["level"] = LogLevel::ToString(m_level);
+  void JsonFormatter::format(LogStream& buf, Logger* logger, LogLevel::Level level, const LogEvent& event) {
+    static const char s_time_fmt[] = "%Y-%m-%d %H:%M:%S";
+    AppendLiteral(buf, "{\"time\":\"");
+    AppendDateTime(buf, s_time_fmt, sizeof(s_time_fmt) - 1, event.getTime());
+    AppendLiteral(buf, ".");
+    AppendSubSecond(buf, event.getUsec(), 6);
+    AppendLiteral(buf, "\",\"level\":\"");
+    size_t idx = (level > LogLevel::UNKONWN && level <= LogLevel::FATAL) ? level : 0;
+    buf.append(s_level_names[idx].str, s_level_names[idx].len);
+    AppendLiteral(buf, "\",\"logger\":");
+    const std::string& name = event.getLogger()->getName();
+    AppendJsonString(buf, name.data(), name.size());
+    AppendLiteral(buf, ",\"thread_id\":");
+    buf.appendUInt(event.getThreadId());
+    AppendLiteral(buf, ",\"thread_name\":");
+    const std::string& thread_name = Thread::GetNameById(event.getThreadNameId());
+    AppendJsonString(buf, thread_name.data(), thread_name.size());
+    AppendLiteral(buf, ",\"fiber_id\":");
+    buf.appendUInt(event.getFiberId());
+    AppendLiteral(buf, ",\"file\":");
+    AppendJsonString(buf, event.getfile(), strlen(event.getfile()));
+    AppendLiteral(buf, ",\"line\":");
+    buf.appendUInt(event.getLine());
+    AppendLiteral(buf, ",\"elapse_ns\":");
+    buf.appendUInt(event.getElapse());
+    AppendLiteral(buf, ",\"msg\":");
+    AppendJsonString(buf, event.getSS().data(), event.getSS().size());
+
+    const LogFields& fields = event.getFields();
+    for(size_t i = 0; i < fields.size(); ++i) {
+      const LogFields::Field& f = fields[i];
+      AppendJsonKey(buf, fields.data(f.key), f.keyLen);
+      switch(f.type) {
+        case LogKV::INT:
+          buf.appendInt(f.i);
+          break;
+        case LogKV::UINT:
+          buf.appendUInt(f.u);
+          break;
+        case LogKV::DOUBLE:
+          AppendJsonDouble(buf, f.d);
+          break;
+        case LogKV::BOOL:
+          buf << f.b;
+          break;
+        case LogKV::STRING:
+          AppendJsonString(buf, fields.data(f.s.off), f.s.len);
+          break;
+      }
     }
-    if(m_hasFormatter && m_formatter) {
-      node["formatter"] = m_formatter->getPattern();
+    if(fields.getDropped()) {
+      AppendLiteral(buf, ",\"dropped_fields\":");
+      buf.appendUInt(fields.getDropped());
     }
-    std::stringstream ss;
-    ss << node;
-    return ss.str();
+    AppendLiteral(buf, "}\n");
   }
 
-  LogFormatter::LogFormatter(const std::string& pattern) 
-    :m_pattern(pattern){
-    init();
-  }
-  
-  std::string LogFormatter::format(Logger::spLOGGER logger, LogLevel::Level level, LogEvent::spLE event) {
-    std::stringstream ss;
-    for(auto& i : m_items){
-      i->format(ss, logger, level, event);
+  void LogFormatter::addLiteral(const std::string& str) {
+    if(!m_program.empty()) {
+      Op& last = m_program.back();
+      if(last.code == OP_LITERAL && last.arg + last.len == m_literals.size()) {
+        m_literals.append(str);
+        last.len += str.size();
+        return;
+      }
     }
-    return ss.str();
+    m_program.push_back(Op{OP_LITERAL, (uint32_t)m_literals.size(), (uint32_t)str.size()});
+    m_literals.append(str);
   }
 
-  std::ostream& LogFormatter::format(std::ostream& ofs, Logger::spLOGGER logger, LogLevel::Level level, LogEvent::spLE event) {
-    for(auto& i : m_items){
-      i->format(ofs, logger, level, event);
+  void LogFormatter::addDateTime(const std::string& fmt) {
+    std::string part;
+    auto flush = [this, &part]() {
+      if(!part.empty()) {
+        m_program.push_back(Op{OP_DATETIME, (uint32_t)m_literals.size(), (uint32_t)part.size()});
+        m_literals.append(part);
+        m_literals.append(1, '\0');
+        part.clear();
+      }
+    };
+
+    for(size_t i = 0; i < fmt.size(); ++i) {
+      if(fmt[i] == '%' && i + 2 < fmt.size() && fmt[i + 2] == 'N'
+          && (fmt[i + 1] == '3' || fmt[i + 1] == '6')) {
+        flush();
+        m_program.push_back(Op{OP_SUBSECOND, (uint32_t)(fmt[i + 1] - '0'), 0});
+        i += 2;
+      }else if(fmt[i] == '%' && i + 1 < fmt.size()) {
+        //keep %% and friends away from the %3N check
+        part.append(fmt, i, 2);
+        ++i;
+      }else {
+        part.append(1, fmt[i]);
+      }
     }
-    return ofs;
+    flush();
   }
+
   //%xxx %xxx{xxx} %%
   void LogFormatter::init() {
     std::vector<std::tuple<std::string, std::string, int>> vec;
@@ -431,6 +2627,7 @@ namespace loongserver {
         //%%
         if(m_pattern[i+1] == '%'){
           nstr.append(1, '%');
+          ++i;
           continue;
         }
       }
@@ -448,7 +2645,7 @@ namespace loongserver {
           str = m_pattern.substr(i + 1, n - i - 1);
           break;
         }
-        if(fmt_status = 0) {
+        if(fmt_status == 0) {
           if(m_pattern[n] == '{'){
             str = m_pattern.substr(i+1, n - i - 1);
             fmt_status = 1;
@@ -490,57 +2687,163 @@ namespace loongserver {
       vec.push_back(std::make_tuple(nstr, "", 0));
     }
 
+    //items run through the opcode loop
+    static std::map<std::string, OpCode> s_format_ops = {
+      {"m", OP_MESSAGE},                  //m:message
+      {"p", OP_LEVEL},                    //p:log level
+      {"c", OP_LOGGER},                   //c:log name
+      {"t", OP_THREAD_ID},                //t:thread id
+      {"F", OP_FIBER_ID},                 //F:fiber id
+      {"l", OP_LINE},                     //l:line number
+    };
+
     //map -> key:string, value:function
     static std::map<std::string, std::function<FormatItem::spFI(const std::string& str)>> s_format_items = {
       #define XX(str, C) \
         {#str, [](const std::string& fmt) {return FormatItem::spFI(new C(fmt));}}
 
-        XX(m, MessageFormatItem),           //m:message
-        XX(p, LevelFormatItem),             //p:log level
         XX(r, ElapseFormatItem),            //r:elapse
-        XX(c, NameFormatItem),              //c:log name
-        XX(t, ThreadIdFormatItem),          //t:thread id
-        XX(n, NewLineFormatItem),           //n:new line
-        XX(d, DateTimeFormatItem),          //d:datetime
         XX(f, FilenameFormatItem),          //f:file name
-        XX(l, LineFormatItem),              //l:line number
-        XX(T, TabFormatItem),               //T:tab
-        XX(F, FiberIdFormatItem),           //F:fiber id
         XX(N, ThreadNameFormatItem),        //N:thread name
       #undef XX
     };
 
     for(auto& i : vec) {
+      const std::string& key = std::get<0>(i);
       if(std::get<2>(i) == 0){
-        m_items.push_back(std::make_shared<FormatItem>(std::get<0>(i)));
-      }else{
-        auto it = s_format_items.find(std::get<0>(i));
+        addLiteral(key);
+      }else if(key == "n") {
+        addLiteral("\n");
+      }else if(key == "T") {
+        addLiteral("\t");
+      }else if(key == "d") {
+        addDateTime(std::get<1>(i).empty() ? "%Y-%m-%d %H:%M:%S" : std::get<1>(i));
+      }else {
+        auto op = s_format_ops.find(key);
+        if(op != s_format_ops.end()) {
+          m_program.push_back(Op{op->second, 0, 0});
+          continue;
+        }
+        auto it = s_format_items.find(key);
         if(it == s_format_items.end()){
-          m_items.push_back(std::make_shared<StringFormatItem>("<<error_format %" + std::get<0>(i) + ">>"));
+          addLiteral("<<error_format %" + key + ">>");
+          m_error = true;
+        }else {
+          m_program.push_back(Op{OP_ITEM, (uint32_t)m_items.size(), 0});
+          m_items.push_back(it->second(std::get<1>(i)));
         }
       }
     }
   }
 
+  static uint64_t HashLoggerName(const char* name, size_t len) {
+    //FNV-1a
+    uint64_t h = 14695981039346656037ull;
+    for(size_t i = 0; i < len; ++i) {
+      h = (h ^ (unsigned char)name[i]) * 1099511628211ull;
+    }
+    return h;
+  }
+
+  /**
+   * @brief immutable open addressing table, load factor at most 1/2
+   * @details loggers are never removed from m_loggers, raw pointers stay valid
+   */
+  struct LoggerManager::LoggerTable {
+    struct Entry {
+      uint64_t  hash {0};
+      Logger*   logger {nullptr};
+    };
+
+    Logger* find(const char* name, size_t len) const {
+      uint64_t h = HashLoggerName(name, len);
+      for(size_t i = h & mask; entries[i].logger; i = (i + 1) & mask) {
+        const Entry& e = entries[i];
+        if(e.hash == h && e.logger->getName().size() == len
+            && memcmp(e.logger->getName().data(), name, len) == 0) {
+          return e.logger;
+        }
+      }
+      return nullptr;
+    }
+
+    std::vector<Entry>  entries;
+    size_t              mask {0};
+  };
+
   LoggerManager::LoggerManager() {
     m_root.reset(new Logger());
+    m_root->setLevel(LogLevel::DEBUG);
     m_root->addAppender(LogAppender::spLA(new StdoutLogAppender));
 
     m_loggers[m_root->m_name] = m_root;
+    publishTable();
 
     init();
   }
 
-  Logger::spLOGGER LoggerManager::getLogger(const std::string& name) {
-    MUTEXTYPE::Lock lock(m_mutex);
-    auto it = m_loggers.find(name);
-    if(it != m_loggers.end()){
-      return it->second;
+  LoggerManager::LoggerTable* LoggerManager::publishTable() {
+    LoggerTable* table = new LoggerTable;
+    size_t cap = 16;
+    while(cap < m_loggers.size() * 2) {
+      cap <<= 1;
+    }
+    table->entries.resize(cap);
+    table->mask = cap - 1;
+    for(auto& i : m_loggers) {
+      uint64_t h = HashLoggerName(i.first.data(), i.first.size());
+      size_t idx = h & table->mask;
+      while(table->entries[idx].logger) {
+        idx = (idx + 1) & table->mask;
+      }
+      table->entries[idx].hash = h;
+      table->entries[idx].logger = i.second.get();
     }
+    return m_table.exchange(table, std::memory_order_acq_rel);
+  }
+
+  Logger::spLOGGER LoggerManager::getLogger(const char* name, size_t len) {
+    {
+      LogEpoch::Guard guard;
+      Logger* logger = m_table.load(std::memory_order_acquire)->find(name, len);
+      if(logger) {
+        return logger->shared_from_this();
+      }
+    }
+    return createLogger(std::string(name, len));
+  }
+
+  Logger::spLOGGER LoggerManager::createLogger(const std::string& name) {
+    Logger::spLOGGER logger;
+    LoggerTable* old = nullptr;
+    {
+      MUTEXTYPE::Lock lock(m_mutex);
+      auto it = m_loggers.find(name);
+      if(it != m_loggers.end()){
+        return it->second;
+      }
 
-    auto logger = std::make_shared<Logger>(name);
-    logger->m_root = m_root;
-    m_loggers[name] = logger;
+      //ancestors first, so every logger has its parent when it is created
+      Logger::spLOGGER parent = m_root;
+      size_t pos = name.find('.');
+      while(pos != std::string::npos) {
+        std::string prefix = name.substr(0, pos);
+        auto& ancestor = m_loggers[prefix];
+        if(!ancestor) {
+          ancestor = std::make_shared<Logger>(prefix);
+          ancestor->m_parent = parent;
+        }
+        parent = ancestor;
+        pos = name.find('.', pos + 1);
+      }
+
+      logger = std::make_shared<Logger>(name);
+      logger->m_parent = parent;
+      m_loggers[name] = logger;
+      old = publishTable();
+    }
+    //readers may wait on m_mutex inside a guard, retire outside of it
+    LogEpoch::RetireDelete(old);
     return logger;
   }
 
@@ -549,12 +2852,34 @@ namespace loongserver {
     LogLevel::Level level = LogLevel::UNKONWN;
     std::string formatter;
     std::string file;
+    bool async = false;
+    uint32_t flush_interval = 1000;
+    uint64_t high_water = 512 * 1024;
+    uint64_t max_size = 0;
+    uint32_t rotate_interval = 0;
+    uint32_t max_files = 0;
+    bool compress = false;
+    uint64_t chunk_size = 32 * 1024 * 1024;
+    uint32_t sync_interval = 1000;
+    uint64_t batch_size = s_log_batch_size;
+    uint32_t batch_delay = s_log_batch_delay;
 
     bool operator==(const LogAppenderDefine& oth) const {
       return type == oth.type
         && level == oth.level
         && formatter == oth.formatter
-        &&  file == oth.file;
+        &&  file == oth.file
+        && async == oth.async
+        && flush_interval == oth.flush_interval
+        && high_water == oth.high_water
+        && max_size == oth.max_size
+        && rotate_interval == oth.rotate_interval
+        && max_files == oth.max_files
+        && compress == oth.compress
+        && chunk_size == oth.chunk_size
+        && sync_interval == oth.sync_interval
+        && batch_size == oth.batch_size
+        && batch_delay == oth.batch_delay;
     }
   };
 
@@ -613,12 +2938,76 @@ namespace loongserver {
                 continue;
               }
               lad.file = a["file"].as<std::string>();
-              if(a["foramtter"].IsDefined()) {
-                lad.formatter = a["foramtter"].as<std::string>();
-              }else {
-                std::cout << "log config error: appender type is invalid, " << a << std::endl;
+              if(a["async"].IsDefined()) {
+                lad.async = a["async"].as<bool>();
+              }
+              if(a["flush_interval"].IsDefined()) {
+                lad.flush_interval = a["flush_interval"].as<uint32_t>();
+              }
+              if(a["high_water"].IsDefined()) {
+                lad.high_water = a["high_water"].as<uint64_t>();
+              }
+              if(a["max_size"].IsDefined()) {
+                lad.max_size = a["max_size"].as<uint64_t>();
+              }
+              if(a["rotate_interval"].IsDefined()) {
+                lad.rotate_interval = a["rotate_interval"].as<uint32_t>();
+              }
+              if(a["max_files"].IsDefined()) {
+                lad.max_files = a["max_files"].as<uint32_t>();
+              }
+              if(a["compress"].IsDefined()) {
+                lad.compress = a["compress"].as<bool>();
+              }
+              if(a["batch_size"].IsDefined()) {
+                lad.batch_size = a["batch_size"].as<uint64_t>();
+              }
+              if(a["batch_delay"].IsDefined()) {
+                lad.batch_delay = a["batch_delay"].as<uint32_t>();
+              }
+              if(a["level"].IsDefined()) {
+                lad.level = LogLevel::ToLog(a["level"].as<std::string>());
+              }
+              if(a["formatter"].IsDefined()) {
+                lad.formatter = a["formatter"].as<std::string>();
+              }
+
+              ld.appenders.push_back(lad);
+            }else if(type == "StdoutLogAppender") {
+              lad.type = 2;
+              if(a["batch_size"].IsDefined()) {
+                lad.batch_size = a["batch_size"].as<uint64_t>();
+              }
+              if(a["batch_delay"].IsDefined()) {
+                lad.batch_delay = a["batch_delay"].as<uint32_t>();
+              }
+              if(a["level"].IsDefined()) {
+                lad.level = LogLevel::ToLog(a["level"].as<std::string>());
+              }
+              if(a["formatter"].IsDefined()) {
+                lad.formatter = a["formatter"].as<std::string>();
+              }
+
+              ld.appenders.push_back(lad);
+            }else if(type == "MmapFileLogAppender") {
+              lad.type = 3;
+              if(!a["file"].IsDefined()) {
+                std::cout << "log config error: mmapfileappender file is null" << a << std::endl;
                 continue;
               }
+              lad.file = a["file"].as<std::string>();
+              if(a["chunk_size"].IsDefined()) {
+                lad.chunk_size = a["chunk_size"].as<uint64_t>();
+              }
+              if(a["sync_interval"].IsDefined()) {
+                lad.sync_interval = a["sync_interval"].as<uint32_t>();
+              }
+              if(a["level"].IsDefined()) {
+                lad.level = LogLevel::ToLog(a["level"].as<std::string>());
+              }
+              if(a["formatter"].IsDefined()) {
+                lad.formatter = a["formatter"].as<std::string>();
+              }
 
               ld.appenders.push_back(lad);
             }
@@ -645,8 +3034,34 @@ namespace loongserver {
             if(a.type == 1){
               na["type"] = "FileLogAppender";
               na["file"] = a.file;
-            }else if(a.type = 2) {
+              if(a.async) {
+                na["async"] = true;
+                na["flush_interval"] = a.flush_interval;
+                na["high_water"] = a.high_water;
+              }
+              if(a.max_size) {
+                na["max_size"] = a.max_size;
+              }
+              if(a.rotate_interval) {
+                na["rotate_interval"] = a.rotate_interval;
+              }
+              if(a.max_files) {
+                na["max_files"] = a.max_files;
+              }
+              if(a.compress) {
+                na["compress"] = true;
+              }
+              na["batch_size"] = a.batch_size;
+              na["batch_delay"] = a.batch_delay;
+            }else if(a.type == 2) {
               na["type"] = "StdoutLogAppender";
+              na["batch_size"] = a.batch_size;
+              na["batch_delay"] = a.batch_delay;
+            }else if(a.type == 3) {
+              na["type"] = "MmapFileLogAppender";
+              na["file"] = a.file;
+              na["chunk_size"] = a.chunk_size;
+              na["sync_interval"] = a.sync_interval;
             }
 
             if(a.level != LogLevel::UNKNOWN) {
@@ -667,51 +3082,156 @@ namespace loongserver {
 
       loongserver::confiVar<std::set<LogDefine>>::spCV g_log_defines = loongserver::Config::Lookup("Logs", std::set<LogDefine>(), "logs config");
 
+      /**
+       * @brief identity of an appender, kept across reloads while it matches
+       */
+      static std::string AppenderKey(int type, const std::string& file) {
+        return std::to_string(type) + ":" + file;
+      }
+
+      static std::string AppenderKey(const LogAppender::spLA& ap) {
+        if(auto fap = std::dynamic_pointer_cast<FileLogAppender>(ap)) {
+          return AppenderKey(1, fap->getFilename());
+        }
+        if(std::dynamic_pointer_cast<StdoutLogAppender>(ap)) {
+          return AppenderKey(2, "");
+        }
+        if(auto map = std::dynamic_pointer_cast<MmapFileLogAppender>(ap)) {
+          return AppenderKey(3, map->getFilename());
+        }
+        return "";
+      }
+
+      /**
+       * @brief bring ap in line with a, oa is its previous define or nullptr
+       */
+      static void UpdateAppender(const std::string& name, const LogAppender::spLA& ap
+                                 ,const LogAppenderDefine& a, const LogAppenderDefine* oa) {
+        if(!oa || oa->level != a.level) {
+          ap->setLevel(a.level);
+        }
+        if(!oa || oa->formatter != a.formatter) {
+          if(a.formatter.empty()) {
+            //back to the logger formatter, already updated by UpdateLogger
+            ap->resetFormatter(LOONGSERVER_LOG_NAME(name)->getFormatter());
+          }else {
+            auto fmt = LogFormatter::Create(a.formatter);
+            if(!fmt->isError()) {
+              ap->setFormatter(fmt);
+            }else {
+              std::cout << "log.name=" << name << " appender type=" << a.type << " formatter=" << a.formatter << " is invalid" << std::endl;
+            }
+          }
+        }
+
+        if(a.type == 1) {
+          auto fap = std::static_pointer_cast<FileLogAppender>(ap);
+          if(!oa || oa->max_size != a.max_size || oa->rotate_interval != a.rotate_interval
+              || oa->max_files != a.max_files || oa->compress != a.compress) {
+            fap->setRotation(a.max_size, a.rotate_interval, a.max_files, a.compress);
+          }
+          if(!oa || oa->async != a.async || oa->flush_interval != a.flush_interval
+              || oa->high_water != a.high_water) {
+            fap->setAsync(a.async, a.flush_interval, a.high_water);
+          }
+          if(!oa || oa->batch_size != a.batch_size || oa->batch_delay != a.batch_delay) {
+            fap->setBatch(a.batch_size, a.batch_delay);
+          }
+        }else if(a.type == 2) {
+          if(!oa || oa->batch_size != a.batch_size || oa->batch_delay != a.batch_delay) {
+            std::static_pointer_cast<StdoutLogAppender>(ap)->setBatch(a.batch_size, a.batch_delay);
+          }
+        }
+      }
+
+      static LogAppender::spLA CreateAppender(const std::string& name, const LogAppenderDefine& a) {
+        loongserver::LogAppender::spLA ap;
+        if(a.type == 1) {
+          ap = std::make_shared<loongserver::FileLogAppender>(a.file);
+        }
+        else if(a.type == 3) {
+          ap = std::make_shared<loongserver::MmapFileLogAppender>(a.file, a.chunk_size, a.sync_interval);
+        }
+        else if(a.type == 2) {
+          if(!loongserver::EnvMgr::GetInstance()->has("d")) {
+            ap = std::make_shared<StdoutLogAppender>();
+          }
+        }
+        if(ap) {
+          UpdateAppender(name, ap, a, nullptr);
+        }
+        return ap;
+      }
+
+      /**
+       * @brief apply the difference between od and ld to logger
+       * @details appenders with the same type and file are updated in place,
+       *          so files stay open and buffers are kept; the new appender
+       *          list is swapped in at once
+       */
+      static void UpdateLogger(const LogDefine& ld, const LogDefine* od) {
+        auto logger = LOONGSERVER_LOG_NAME(ld.name);
+        if(!od || od->level != ld.level) {
+          logger->setLevel(ld.level);
+        }
+        if((!od || od->formatter != ld.formatter) && !ld.formatter.empty()) {
+          logger->setFormatter(ld.formatter);
+        }
+        if(od && od->appenders == ld.appenders) {
+          return;
+        }
+
+        std::multimap<std::string, LogAppender::spLA> current;
+        for(auto& i : logger->getAppenders()) {
+          current.insert(std::make_pair(AppenderKey(i), i));
+        }
+        std::map<std::string, const LogAppenderDefine*> previous;
+        if(od) {
+          for(auto& i : od->appenders) {
+            previous.insert(std::make_pair(AppenderKey(i.type, i.file), &i));
+          }
+        }
+
+        std::vector<LogAppender::spLA> appenders;
+        for(auto& a : ld.appenders) {
+          std::string key = AppenderKey(a.type, a.file);
+          auto pit = previous.find(key);
+          const LogAppenderDefine* oa = pit == previous.end() ? nullptr : pit->second;
+          auto cit = current.find(key);
+          //mapping size is fixed when the file is mapped
+          if(cit != current.end() && a.type == 3 && oa
+              && (oa->chunk_size != a.chunk_size || oa->sync_interval != a.sync_interval)) {
+            current.erase(cit);
+            cit = current.end();
+          }
+
+          LogAppender::spLA ap;
+          if(cit != current.end()) {
+            ap = cit->second;
+            current.erase(cit);
+            UpdateAppender(ld.name, ap, a, oa);
+          }else {
+            ap = CreateAppender(ld.name, a);
+          }
+          if(ap) {
+            appenders.push_back(ap);
+          }
+        }
+        //what is left in current is dropped once no writer uses it
+        logger->setAppenders(appenders);
+      }
+
       struct LogIniter {
         LogIniter(){
-          g_log_defines->addListener([](const std::set<logDefine)>& old_value,
+          g_log_defines->addListener([](const std::set<LogDefine>& old_value,
             const std::set<LogDefine>& new_value){
               LOONGSERVER_LOG_INFO(LOONGSERVER_LOG_ROOT()) << "on_logger_conf_changed";
               for(auto& i : new_value){
                 auto it = old_value.find(i);
-                loongserver::Logger::spLOGGER logger;
                 if(it == old_value.end()){
-                  logger = LOONGSERVER_LOG_NAME(i.name);
-                }else{
-                  if(!(i == *it)) {
-                    logger = LOONGSERVER_LOG_NAME(i.name);
-                  }else{
-                    continue;
-                  }
-                }
-                logger->setLevel(i.level);
-                if(!i.formatter.empty()) {
-                  logger->setFormatter(i.formatter);
-                }
-
-                logger->clearAppenders();
-                for(auto& a : i.appenders) {
-                  loongserver::LogAppender::spLA ap;
-                  if(a.type == 1) {
-                    ap = std::make_shared<loongserver::LogAppender>(a.file);
-                  }
-                  else if(a.type == 2) {
-                    if(!loongserver::EnvMgr::GetInstance()->has("d")) {
-                      ap = std::make_shared<StdoutLogAppender>();
-                    }else {
-                      continue;
-                    }
-                  }
-                  ap->setlevel(a.level);
-                  if(!a.formatter.empty()) {
-                    auto fmt = std::make_shared<LogFormatter>(a.formatter);
-                    if(!fmt->isError()) {
-                      ap->setFormatter(fmt);
-                    }else {
-                      std::cout << "log.name=" << i.name << " appender type=" << a.type << " formatter=" << a.formatter << " is invalid" << std::endl;
-                    }
-                  }
-                  logger->addAppender(ap);
+                  UpdateLogger(i, nullptr);
+                }else if(!(i == *it)) {
+                  UpdateLogger(i, &*it);
                 }
               }// for
               for(auto& i : old_value) {
@@ -742,5 +3262,7 @@ namespace loongserver {
     return ss.str();
   }
 
-  void LoggerManager::init() {}
+  void LoggerManager::init() {
+    LogCrash::Install();
+  }
 }
\ No newline at end of file
@@ -1,77 +1,127 @@
 #ifndef __LOONGSERVER_LOG_H__
-#define __LOONGSERFER_LOG_H__
+#define __LOONGSERVER_LOG_H__
 
 #include <iostream>
 #include <memory>
 #include <mutex>
+#include <cstring>
+#include <cstdarg>
 #include <fstream>
+#include <cstdio>
 #include <string>
 #include <fstream>
 #include <sstream>
 #include <vector>
 #include <list>
 #include <map>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
+#include <functional>
+#include <sys/uio.h>
 
+#include "util.h"
 #include "thread.h"
 #include "singleton.h"
+#include "noncopyable.h"
+
+/**
+ * @brief lowest log level compiled into the LOONGSERVER_LOG_* entry points
+ * @details call sites below it are removed together with their arguments,
+ *          set through LOONGSERVER_LOG_MIN_LEVEL in CMakeLists.txt
+ */
+#ifndef LOONGSERVER_LOG_MIN_LEVEL
+#define LOONGSERVER_LOG_MIN_LEVEL 1
+#endif
 
 /**
  * @brief put log into logger using stream
+ * @details expands to if(disabled) {} else stream, so an else written after
+ *          the statement still binds to the caller's if
  */
-inline void LOONGSERVER_LOG_LEVEL(std::shared_ptr<loongserver::Logger> logger, loongserver::LogLevel::Level level){
-  if(logger->getLevel() <= level){
-    loongserver::LogEventWrap(loongserver::LogEvent::spLE(new loongserver::LogEvent(logger, level, 
-      __FILE__, __LINE__, 0, 
-      loongserver::GetThreadId(),loongserver::GetFiberId(), time(0), loongserver::Thread::GetName()))).getSS();
-  }
-}
+#define LOONGSERVER_LOG_LEVEL(logger, level) \
+  if((level) < LOONGSERVER_LOG_MIN_LEVEL || !logger->isEnabled(level)) {} \
+  else \
+    loongserver::LogEventWrap(loongserver::LogEvent::Create(logger, level, \
+      __FILE__, __LINE__, loongserver::GetMonotonicNS(), \
+      loongserver::GetThreadId(),loongserver::GetFiberId(), loongserver::GetCoarseCurrentUS(), loongserver::Thread::GetNameId())).getSS()
 
-inline void LOONGSERVER_LOG_DEBUG(std::shared_ptr<loongserver::Logger> logger) { LOONGSERVER_LOG_LEVEL(logger, loongserver::LogLevel::DEBUG); }
-inline void LOONGSERVER_LOG_INFO(std::shared_ptr<loongserver::Logger> logger) { LOONGSERVER_LOG_LEVEL(logger, loongserver::LogLevel::INFO); }
-inline void LOONGSERVER_LOG_WARN(std::shared_ptr<loongserver::Logger> logger) { LOONGSERVER_LOG_LEVEL(logger, loongserver::LogLevel::WARN); }
-inline void LOONGSERVER_LOG_ERROR(std::shared_ptr<loongserver::Logger> logger) { LOONGSERVER_LOG_LEVEL(logger, loongserver::LogLevel::ERROR); }
-inline void LOONGSERVER_LOG_FATAL(std::shared_ptr<loongserver::Logger> logger) { LOONGSERVER_LOG_LEVEL(logger, loongserver::LogLevel::FATAL); }
+#define LOONGSERVER_LOG_DEBUG(logger) LOONGSERVER_LOG_LEVEL(logger, loongserver::LogLevel::DEBUG)
+#define LOONGSERVER_LOG_INFO(logger) LOONGSERVER_LOG_LEVEL(logger, loongserver::LogLevel::INFO)
+#define LOONGSERVER_LOG_WARN(logger) LOONGSERVER_LOG_LEVEL(logger, loongserver::LogLevel::WARN)
+#define LOONGSERVER_LOG_ERROR(logger) LOONGSERVER_LOG_LEVEL(logger, loongserver::LogLevel::ERROR)
+#define LOONGSERVER_LOG_FATAL(logger) LOONGSERVER_LOG_LEVEL(logger, loongserver::LogLevel::FATAL)
 
 /**
  * @brief put log into logger using formatter
  */
-inline void LOONGSEVER_LOG_FMT_LEVEL(std::shared_ptr<loongserver::Logger> logger, loongserver::LogLevel::Level level, std::shared_ptr<loongserver::LogFormatter> fmt, ...) {
-  if (logger->getLevel() <= level) {
-    loongserver::LogEventWrap(loongserver::LogEvent::spLE(new loongserver::LogEvent(logger, level, 
-      __FILE__, __LINE__, 0, 
-      loongserver::GetThreadId(),loongserver::GetFiberId(), time(0), loongserver::Thread::GetName()))).getEvent()->format(fmt, __VA_ARGS__);
-  }
-}
+#define LOONGSERVER_LOG_FMT_LEVEL(logger, level, fmt, ...) \
+  if((level) < LOONGSERVER_LOG_MIN_LEVEL || !logger->isEnabled(level)) {} \
+  else \
+    loongserver::LogEventWrap(loongserver::LogEvent::Create(logger, level, \
+      __FILE__, __LINE__, loongserver::GetMonotonicNS(), \
+      loongserver::GetThreadId(),loongserver::GetFiberId(), loongserver::GetCoarseCurrentUS(), loongserver::Thread::GetNameId())).getEvent()->format(fmt, __VA_ARGS__)
 
-inline void LOONGSEVER_LOG_FMT_DEBUG(std::shared_ptr<loongserver::Logger> logger, std::shared_ptr<loongserver::LogFormatter> fmt, ...){
-  LOONGSEVER_LOG_FMT_LEVEL(logger, loongserver::LogLevel::DEBUG, fmt, __VA_ARGS__);
-}
-inline void LOONGSEVER_LOG_FMT_INFO(std::shared_ptr<loongserver::Logger> logger, std::shared_ptr<loongserver::LogFormatter> fmt, ...){
-  LOONGSEVER_LOG_FMT_LEVEL(logger, loongserver::LogLevel::INFO, fmt, __VA_ARGS__);
-}
-inline void LOONGSEVER_LOG_FMT_WARN(std::shared_ptr<loongserver::Logger> logger, std::shared_ptr<loongserver::LogFormatter> fmt, ...){
-  LOONGSEVER_LOG_FMT_LEVEL(logger, loongserver::LogLevel::WARN, fmt, __VA_ARGS__);
-}
-inline void LOONGSEVER_LOG_FMT_ERROR(std::shared_ptr<loongserver::Logger> logger, std::shared_ptr<loongserver::LogFormatter> fmt, ...){
-  LOONGSEVER_LOG_FMT_LEVEL(logger, loongserver::LogLevel::ERROR, fmt, __VA_ARGS__);
-}
-inline void LOONGSEVER_LOG_FMT_FATAL(std::shared_ptr<loongserver::Logger> logger, std::shared_ptr<loongserver::LogFormatter> fmt, ...){
-  LOONGSEVER_LOG_FMT_LEVEL(logger, loongserver::LogLevel::FATAL, fmt, __VA_ARGS__);
-}
+#define LOONGSERVER_LOG_FMT_DEBUG(logger, fmt, ...) LOONGSERVER_LOG_FMT_LEVEL(logger, loongserver::LogLevel::DEBUG, fmt, __VA_ARGS__)
+#define LOONGSERVER_LOG_FMT_INFO(logger, fmt, ...) LOONGSERVER_LOG_FMT_LEVEL(logger, loongserver::LogLevel::INFO, fmt, __VA_ARGS__)
+#define LOONGSERVER_LOG_FMT_WARN(logger, fmt, ...) LOONGSERVER_LOG_FMT_LEVEL(logger, loongserver::LogLevel::WARN, fmt, __VA_ARGS__)
+#define LOONGSERVER_LOG_FMT_ERROR(logger, fmt, ...) LOONGSERVER_LOG_FMT_LEVEL(logger, loongserver::LogLevel::ERROR, fmt, __VA_ARGS__)
+#define LOONGSERVER_LOG_FMT_FATAL(logger, fmt, ...) LOONGSERVER_LOG_FMT_LEVEL(logger, loongserver::LogLevel::FATAL, fmt, __VA_ARGS__)
+
+/**
+ * @brief put log into logger when the call site's LogLimiter lets it pass
+ * @details limiter state is a static object of the call site, suppressed
+ *          records are counted and reported with the next record that passes
+ *          or by a periodic summary
+ */
+#define LOONGSERVER_LOG_LIMITED(logger, level, policy, a, b) \
+  if((level) < LOONGSERVER_LOG_MIN_LEVEL || !logger->isEnabled(level)) {} \
+  else if(loongserver::LogSuppressed __loongserver_suppressed = loongserver::LogSuppressed::FromPass( \
+        ([&]() -> loongserver::LogLimiter& { \
+        static loongserver::LogLimiter __loongserver_limiter(policy, a, b, level, __FILE__, __LINE__); \
+        return __loongserver_limiter; })().pass(logger))) {} \
+  else \
+    loongserver::LogEventWrap(loongserver::LogEvent::Create(logger, level, \
+      __FILE__, __LINE__, loongserver::GetMonotonicNS(), \
+      loongserver::GetThreadId(),loongserver::GetFiberId(), loongserver::GetCoarseCurrentUS(), loongserver::Thread::GetNameId())).getSS() \
+      << __loongserver_suppressed
+
+/**
+ * @brief at most per_second records on average, bursts up to burst
+ */
+#define LOONGSERVER_LOG_RATE_LIMITED(logger, level, per_second, burst) \
+  LOONGSERVER_LOG_LIMITED(logger, level, loongserver::LogLimiter::TOKEN_BUCKET, per_second, burst)
+/**
+ * @brief 1 record of every n
+ */
+#define LOONGSERVER_LOG_EVERY_N(logger, level, n) \
+  LOONGSERVER_LOG_LIMITED(logger, level, loongserver::LogLimiter::EVERY_N, n, 0)
+/**
+ * @brief the first n records, then every m-th
+ */
+#define LOONGSERVER_LOG_FIRST_N_EVERY_M(logger, level, n, m) \
+  LOONGSERVER_LOG_LIMITED(logger, level, loongserver::LogLimiter::FIRST_N_EVERY_M, n, m)
 
 /**
  * @brief get root logger
  */
-inline auto LOONGSERVER_LOG_ROOT(){
-  return loongserver::sLOGGERMGR::getInstance()->getRoot();
-}
+#define LOONGSERVER_LOG_ROOT() loongserver::sLOGGERMGR::GetInstance()->getRoot()
 
 /**
- * @brief get logger by name
+ * @brief get logger by name, lock free once the logger exists
  */
-inline auto LOONGSERVER_LOG_NAME(std::string name) {
-  return loongserver::sLOGGERMGR::GetInstance()->getLogger(name);
-}
+#define LOONGSERVER_LOG_NAME(name) loongserver::sLOGGERMGR::GetInstance()->getLogger(name)
+
+/**
+ * @brief get logger by name, looked up once per call site
+ * @details later calls cost one pointer load, name must not change between
+ *          calls of the same call site
+ */
+#define LOONGSERVER_LOG_NAME_CACHED(name) \
+  (*([&]() -> const loongserver::Logger::spLOGGER* { \
+    static const loongserver::Logger::spLOGGER __loongserver_logger = LOONGSERVER_LOG_NAME(name); \
+    return &__loongserver_logger; })())
+
 namespace loongserver{
 class Logger;
 class LoggerManager;
@@ -113,11 +163,336 @@ public:
   static LogLevel::Level ToLog(const std::string& str);
 };
 
-class LogEvent {
+/**
+ * @brief append-only character stream with inline storage
+ * @details content lives in the object until it outgrows INLINE_SIZE, then
+ *          spills to the heap; replaces std::stringstream on the hot path
+ */
+class LogFields;
+
+class LogStream : Noncopyable {
+public:
+  static const size_t INLINE_SIZE = 512;
+
+  LogStream() {}
+  ~LogStream() {
+    if(m_data != m_inline) {
+      free(m_data);
+    }
+  }
+
+  /**
+   * @brief append raw bytes
+   */
+  void append(const char* str, size_t len) {
+    if(m_size + len > m_cap) {
+      grow(m_size + len);
+    }
+    memcpy(m_data + m_size, str, len);
+    m_size += len;
+  }
+  /**
+   * @brief append printf style content
+   */
+  void appendFormat(const char* fmt, va_list al);
+  /**
+   * @brief append unsigned integer in decimal
+   */
+  void appendUInt(uint64_t val);
+  /**
+   * @brief append signed integer in decimal
+   */
+  void appendInt(int64_t val);
+  /**
+   * @brief return content, not null terminated
+   */
+  const char* data() const { return m_data; }
+  /**
+   * @brief return content length
+   */
+  size_t size() const { return m_size; }
+  /**
+   * @brief drop content and format state, keep capacity
+   */
+  void clear() {
+    m_size = 0;
+    m_formatted = false;
+    m_os.reset();
+  }
+  /**
+   * @brief return copy of content
+   */
+  std::string str() const { return std::string(m_data, m_size); }
+  /**
+   * @brief return structured fields of the event owning this stream
+   */
+  LogFields* getFields() const { return m_fields; }
+  /**
+   * @brief attach structured fields, kv() goes there instead of the text
+   */
+  void setFields(LogFields* val) { m_fields = val; }
+
+  //the fast paths below only hold while no manipulator changed the format
+  LogStream& operator<<(const char* v) {
+    if(m_formatted) {
+      return writeStream(v ? v : "");
+    }
+    if(v) {
+      append(v, strlen(v));
+    }
+    return *this;
+  }
+  LogStream& operator<<(const std::string& v) {
+    if(m_formatted) {
+      return writeStream(v);
+    }
+    append(v.data(), v.size());
+    return *this;
+  }
+  LogStream& operator<<(char v) {
+    if(m_formatted) {
+      return writeStream(v);
+    }
+    append(&v, 1);
+    return *this;
+  }
+  LogStream& operator<<(bool v) { return *this << (v ? "true" : "false"); }
+  LogStream& operator<<(short v) { return m_formatted ? writeStream(v) : (appendInt(v), *this); }
+  LogStream& operator<<(unsigned short v) { return m_formatted ? writeStream(v) : (appendUInt(v), *this); }
+  LogStream& operator<<(int v) { return m_formatted ? writeStream(v) : (appendInt(v), *this); }
+  LogStream& operator<<(unsigned int v) { return m_formatted ? writeStream(v) : (appendUInt(v), *this); }
+  LogStream& operator<<(long v) { return m_formatted ? writeStream(v) : (appendInt(v), *this); }
+  LogStream& operator<<(unsigned long v) { return m_formatted ? writeStream(v) : (appendUInt(v), *this); }
+  LogStream& operator<<(long long v) { return m_formatted ? writeStream(v) : (appendInt(v), *this); }
+  LogStream& operator<<(unsigned long long v) { return m_formatted ? writeStream(v) : (appendUInt(v), *this); }
+  LogStream& operator<<(float v) { return *this << static_cast<double>(v); }
+  LogStream& operator<<(double v);
+  LogStream& operator<<(const void* v);
+  /**
+   * @brief std::endl ends the line, std::flush, std::ends and the other
+   *        ostream manipulators behave as on std::ostream
+   */
+  LogStream& operator<<(std::ostream& (*pf)(std::ostream&)) {
+    if(pf == static_cast<std::ostream& (*)(std::ostream&)>(std::endl<char, std::char_traits<char>>)) {
+      append("\n", 1);
+      return *this;
+    }
+    return writeStream(pf);
+  }
+  /**
+   * @brief std::hex, std::fixed and the other format flags, they apply to
+   *        the values streamed after them
+   */
+  LogStream& operator<<(std::ios_base& (*pf)(std::ios_base&)) {
+    return writeStream(pf);
+  }
+  /**
+   * @brief std::setw, std::setprecision and types which only know how to
+   *        print into std::ostream
+   */
+  template<class T>
+  LogStream& operator<<(const T& v) {
+    return writeStream(v);
+  }
+
+private:
+  /**
+   * @brief make room for at least n bytes
+   */
+  void grow(size_t n);
+
+  /**
+   * @brief print v through the ostream which keeps flags, width and precision
+   */
+  template<class T>
+  LogStream& writeStream(const T& v) {
+    if(!m_os) {
+      m_os.reset(new std::ostringstream);
+    }
+    m_os->str(std::string());
+    *m_os << v;
+    const std::string& str = m_os->str();
+    append(str.data(), str.size());
+    m_formatted = m_os->flags() != (std::ios_base::dec | std::ios_base::skipws)
+        || m_os->width() != 0 || m_os->precision() != 6 || m_os->fill() != ' ';
+    return *this;
+  }
+
+private:
+  char*       m_data {m_inline};
+  size_t      m_size {0};
+  size_t      m_cap {INLINE_SIZE};
+  LogFields*  m_fields {nullptr};
+  /// @brief format state, created by the first value printed through it
+  std::unique_ptr<std::ostringstream> m_os;
+  /// @brief m_os holds flags, width or precision the fast paths would ignore
+  bool        m_formatted {false};
+  char        m_inline[INLINE_SIZE];
+};
+
+/**
+ * @brief typed key/value pair, built by kv()
+ * @details only refers to key and value, LogFields copies them
+ */
+struct LogKV {
+  enum Type {
+    INT,
+    UINT,
+    DOUBLE,
+    BOOL,
+    STRING,
+  };
+
+  LogKV(const char* k, bool v) : key(k), type(BOOL) { b = v; }
+  LogKV(const char* k, int v) : key(k), type(INT) { i = v; }
+  LogKV(const char* k, long v) : key(k), type(INT) { i = v; }
+  LogKV(const char* k, long long v) : key(k), type(INT) { i = v; }
+  LogKV(const char* k, unsigned int v) : key(k), type(UINT) { u = v; }
+  LogKV(const char* k, unsigned long v) : key(k), type(UINT) { u = v; }
+  LogKV(const char* k, unsigned long long v) : key(k), type(UINT) { u = v; }
+  LogKV(const char* k, double v) : key(k), type(DOUBLE) { d = v; }
+  LogKV(const char* k, const char* v) : key(k), type(STRING) {
+    s.data = v ? v : "";
+    s.len = strlen(s.data);
+  }
+  LogKV(const char* k, const std::string& v) : key(k), type(STRING) {
+    s.data = v.data();
+    s.len = v.size();
+  }
+
+  const char* key;
+  Type        type;
+  union {
+    int64_t   i;
+    uint64_t  u;
+    double    d;
+    bool      b;
+    struct {
+      const char* data;
+      size_t      len;
+    } s;
+  };
+};
+
+/**
+ * @brief structured field for the log stream
+ * @details LOONGSERVER_LOG_INFO(g_logger) << "login" << kv("user", name);
+ */
+template<class T>
+LogKV kv(const char* key, const T& val) {
+  return LogKV(key, val);
+}
+
+/**
+ * @brief attach kv to the event of os, or write key=value when os has none
+ */
+LogStream& operator<<(LogStream& os, const LogKV& v);
+
+/**
+ * @brief typed key/value fields of one event, stored inline
+ * @details keys and string values are copied into one buffer, fields past
+ *          MAX_FIELDS are counted as dropped
+ */
+class LogFields : Noncopyable {
+public:
+  static const size_t MAX_FIELDS = 16;
+
+  struct Field {
+    uint32_t    key;
+    uint32_t    keyLen;
+    LogKV::Type type;
+    union {
+      int64_t   i;
+      uint64_t  u;
+      double    d;
+      bool      b;
+      struct {
+        uint32_t  off;
+        uint32_t  len;
+      } s;
+    };
+  };
+
+  /**
+   * @brief copy kv in
+   */
+  void add(const LogKV& kv);
+  /**
+   * @brief return field count
+   */
+  size_t size() const { return m_count; }
+  /**
+   * @brief return fields not stored, MAX_FIELDS exceeded
+   */
+  uint32_t getDropped() const { return m_dropped; }
+  /**
+   * @brief return field i
+   */
+  const Field& operator[](size_t i) const { return m_fields[i]; }
+  /**
+   * @brief return bytes of a key or string value
+   */
+  const char* data(uint32_t off) const { return m_data.data() + off; }
+
+private:
+  Field     m_fields[MAX_FIELDS];
+  uint32_t  m_count {0};
+  uint32_t  m_dropped {0};
+  LogStream m_data;
+};
+
+/**
+ * @brief thread local free lists backing LogEvent allocation
+ * @details blocks freed on another thread join that thread's list, every
+ *          list is capped and gives surplus back to the heap
+ */
+class LogEventPool {
+public:
+  /**
+   * @brief return block of size bytes
+   */
+  static void* Alloc(size_t size);
+  /**
+   * @brief give block back to the calling thread's free list
+   */
+  static void Dealloc(void* ptr, size_t size);
+};
+
+/**
+ * @brief std allocator adapter over LogEventPool
+ */
+template<class T>
+class LogEventAllocator {
+public:
+  using value_type = T;
+
+  LogEventAllocator() = default;
+  template<class U>
+  LogEventAllocator(const LogEventAllocator<U>&) {}
+
+  T* allocate(size_t n) { return static_cast<T*>(LogEventPool::Alloc(n * sizeof(T))); }
+  void deallocate(T* p, size_t n) { LogEventPool::Dealloc(p, n * sizeof(T)); }
+
+  template<class U>
+  bool operator==(const LogEventAllocator<U>&) const { return true; }
+  template<class U>
+  bool operator!=(const LogEventAllocator<U>&) const { return false; }
+};
+
+class LogEvent : Noncopyable {
 public:
   using spLE = std::shared_ptr<LogEvent>;
   using LOGLEVEL = LogLevel::Level;
 
+  /**
+   * @brief create event, event and control block come from LogEventPool
+   * @param[in] same as constructor
+   */
+  static spLE Create(const std::shared_ptr<Logger>& logger, LogLevel::Level level
+            ,const char* file, int32_t line, uint64_t elapse
+            ,uint32_t thread_id, uint32_t fiber_id, uint64_t time
+            ,uint32_t thread_name_id);
+
   /**
    * @brief constructor function
    * @param[in] total params are nine
@@ -125,16 +500,16 @@ public:
    * @param[in] level
    * @param[in] file
    * @param[in] line
-   * @param[in] elapse
+   * @param[in] elapse monotonic nanoseconds since process start
    * @param[in] thread_id
    * @param[in] fiber_id
-   * @param[in] time
-   * @param[in] thread_name
+   * @param[in] time wall clock in microseconds
+   * @param[in] thread_name_id interned name, see Thread::GetNameById
    */
-  LogEvent(std::shared_ptr<Logger> logger, LogLevel::Level level
-            ,const char* file, int32_t line, uint32_t elapse
+  LogEvent(const std::shared_ptr<Logger>& logger, LogLevel::Level level
+            ,const char* file, int32_t line, uint64_t elapse
             ,uint32_t thread_id, uint32_t fiber_id, uint64_t time
-            ,const std::string& thread_name);
+            ,uint32_t thread_name_id);
   /**
    * @brief return filename
    */
@@ -144,7 +519,7 @@ public:
    */
   uint32_t getLine() const { return m_line; };
   /**
-   * @brief return elapse
+   * @brief return monotonic nanoseconds since process start
    */
   uint64_t getElapse() const { return m_elapse; };
   /**
@@ -156,29 +531,41 @@ public:
    */
   uint32_t getFiberId() const { return m_fiberId; };
   /**
-   * @brief return time
+   * @brief return time in seconds
    */
   uint64_t getTime() const { return m_time; };
   /**
-   * @brief return thread name
+   * @brief return microseconds within the second
+   */
+  uint32_t getUsec() const { return m_usec; };
+  /**
+   * @brief return interned thread name id
    */
-  const std::string& getThreadName() const { return m_threadName; };
+  uint32_t getThreadNameId() const { return m_threadNameId; };
   /**
    * @brief return LOG content
    */
   std::string getContent() const { return m_ss.str(); };
   /**
-   * @brief return logger
+   * @brief return logger, it outlives the event
    */
-  std::shared_ptr<Logger> getLogger() const { return m_logger; };
+  Logger* getLogger() const { return m_logger; };
   /**
    * @brief return log level
    */
   LOGLEVEL getLevel() const{ return m_level; };
+  /**
+   * @brief return structured fields
+   */
+  const LogFields& getFields() const { return m_fields; }
   /**
    * @brief return string stream
    */
-  std::stringstream& getSS() { return m_ss; }
+  LogStream& getSS() { return m_ss; }
+  /**
+   * @brief return string stream
+   */
+  const LogStream& getSS() const { return m_ss; }
   /**
    * @brief format written LOG content/ user interface
    */
@@ -195,10 +582,12 @@ private:
   uint32_t          m_threadId {0};
   uint32_t          m_fiberId {0};
   uint64_t          m_time {0};
-  std::string       m_threadName;
-  std::shared_ptr<Logger>  m_logger;
+  uint32_t          m_usec {0};
+  uint32_t          m_threadNameId {0};
+  Logger*           m_logger {nullptr};
   LOGLEVEL          m_level;
-  std::stringstream m_ss;
+  LogStream         m_ss;
+  LogFields         m_fields;
 };
 
 class LogEventWrap {
@@ -213,7 +602,7 @@ public:
   /** 
    * @brief 返回日志内容流
    */
-  std::stringstream& getSS();
+  LogStream& getSS();
 
 private:
   LogEvent::spLE m_event;
@@ -228,11 +617,11 @@ public:
    * @details 
      *  %m message
      *  %p level
-     *  %r elapse
+     *  %r elapse since process start, %r{ms} (default), %r{us} or %r{ns}
      *  %c log name
      *  %t thread id
      *  %n next line
-     *  %d time
+     *  %d time, %d{...} takes strftime format plus %3N (ms) and %6N (us)
      *  %f file name
      *  %l line number
      *  %T tab
@@ -242,14 +631,27 @@ public:
      *  default format "%d{%Y-%m-%d %H:%M:%S}%T%t%T%N%T%F%T[%p]%T[%c]%T%f:%l%T%m%n"
    */
   LogFormatter(const std::string& pattern);
+  virtual ~LogFormatter() {}
+  /**
+   * @brief create formatter for pattern, "json" gives a JsonFormatter
+   */
+  static spLF Create(const std::string& pattern);
+  /**
+   * @brief run compiled pattern, append formatted log content to buf
+   * @param[in] buf
+   * @param[in] logger
+   * @param[in] level
+   * @param[in] event
+   */
+  virtual void format(LogStream& buf, Logger* logger, LogLevel::Level level, const LogEvent& event);
   /**
    * @brief return formatted log content
    * @param[in] logger
    * @param[in] level
    * @param[in] event
    */
-  std::string format(std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::spLE event);
-  std::ostream& format(std::ostream& ofs, std::shared_ptr<Logger> logger, LogLevel::Level, LogEvent::spLE event);
+  std::string format(const std::shared_ptr<Logger>& logger, LogLevel::Level level, const LogEvent::spLE& event);
+  std::ostream& format(std::ostream& ofs, const std::shared_ptr<Logger>& logger, LogLevel::Level, const LogEvent::spLE& event);
 public:
   class FormatItem {
     public:
@@ -259,7 +661,7 @@ public:
       /**
        * @brief foramt log stream
        */
-      virtual void format(std::ostream& os, std::shared_ptr<Logger> Logger, LogLevel::Level level, LogEvent::spLE event) = 0;
+      virtual void format(LogStream& os, Logger* logger, LogLevel::Level level, const LogEvent& event) = 0;
   };
   /**
    * @brief init log template
@@ -273,12 +675,119 @@ public:
    * @brief return pattern
    */
   const std::string getPattern() const {return m_pattern; }
+  /**
+   * @brief return process unique id, equal ids render equal output
+   */
+  uint64_t getId() const { return m_id; }
 private:
+  /**
+   * @brief instruction of the compiled pattern
+   */
+  enum OpCode {
+    /** copy m_literals[arg, arg + len) */
+    OP_LITERAL,
+    /** %m */
+    OP_MESSAGE,
+    /** %p */
+    OP_LEVEL,
+    /** %c */
+    OP_LOGGER,
+    /** %t */
+    OP_THREAD_ID,
+    /** %F */
+    OP_FIBER_ID,
+    /** %l */
+    OP_LINE,
+    /** %d, strftime format is the null terminated literal at arg */
+    OP_DATETIME,
+    /** %3N %6N inside %d{}, arg is the number of digits */
+    OP_SUBSECOND,
+    /** call m_items[arg] */
+    OP_ITEM,
+  };
+
+  struct Op {
+    OpCode    code;
+    uint32_t  arg;
+    uint32_t  len;
+  };
+
+  /**
+   * @brief append literal, merged into the previous literal if possible
+   */
+  void addLiteral(const std::string& str);
+  /**
+   * @brief compile %d{fmt} into datetime and sub-second ops
+   */
+  void addDateTime(const std::string& fmt);
+private:
+  uint64_t                      m_id;
   std::string                   m_pattern;
+  std::vector<Op>               m_program;
+  std::string                   m_literals;
   std::vector<FormatItem::spFI> m_items;
   bool                          m_error {false};
 };
 
+/**
+ * @brief one JSON object per line
+ * @details {"time":"2024-01-02 03:04:05.678901","level":"INFO","logger":"root",
+ *          "thread_id":1,"thread_name":"main","fiber_id":0,"file":"a.cc",
+ *          "line":1,"elapse_ns":123,"msg":"...", fields...}
+ *          encoded straight into the output buffer, selected by pattern "json"
+ */
+class JsonFormatter : public LogFormatter {
+public:
+  JsonFormatter();
+  void format(LogStream& buf, Logger* logger, LogLevel::Level level, const LogEvent& event) override;
+};
+
+/**
+ * @brief epoch based reclamation for read-mostly log structures
+ * @details readers enter a Guard and use published pointers without locks,
+ *          writers publish a new copy and Retire the old one, which is freed
+ *          once every reader that could still see it has left its Guard
+ */
+class LogEpoch : Noncopyable {
+public:
+  /**
+   * @brief read side critical section, may nest
+   */
+  class Guard : Noncopyable {
+  public:
+    Guard() { LogEpoch::Enter(); }
+    ~Guard() { LogEpoch::Leave(); }
+  };
+
+  /**
+   * @brief run cb once no reader can reference the retired object
+   * @details called inside a Guard cb runs when the outermost Guard is left
+   */
+  static void Retire(std::function<void()> cb);
+
+  /**
+   * @brief retire ptr, deleting it with delete
+   */
+  template<class T>
+  static void RetireDelete(T* ptr) {
+    if(ptr) {
+      Retire([ptr](){ delete ptr; });
+    }
+  }
+
+private:
+  static void Enter();
+  static void Leave();
+  /**
+   * @brief wait until every reader has left the Guard it was in
+   */
+  static void Synchronize();
+  /**
+   * @brief synchronize and run what is retired, outside any Guard
+   */
+  static void RunRetired();
+};
+
 class LogAppender {
   friend class Logger;
 
@@ -294,7 +803,7 @@ public:
    * @param[in] level
    * @param[in] event
    */
-  virtual void log(std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::spLE event) = 0;
+  virtual void log(Logger* logger, LogLevel::Level level, const LogEvent::spLE& event) = 0;
   /**
    * @brief convert to Yaml string
    */
@@ -305,6 +814,12 @@ public:
    */
   void setFormatter(LogFormatter::spLF val);
 
+  /**
+   * @brief drop the own formatter and use val, the formatter of the owning logger
+   * @details m_formatter is never null in between, render reads it
+   */
+  void resetFormatter(LogFormatter::spLF val);
+
   /**
    * @brief get formatter
    */
@@ -313,22 +828,32 @@ public:
   /**
    * @brief get level
    */
-  LogLevel::Level getLevel() const { return m_level; }
+  LogLevel::Level getLevel() const { return m_level.load(std::memory_order_relaxed); }
 
   /**
    * @brief set level
    */
-  void setLevel(LogLevel::Level val) { m_level = val; }
+  void setLevel(LogLevel::Level val) { m_level.store(val, std::memory_order_relaxed); }
+
+protected:
+  /**
+   * @brief render event with m_formatter, m_mutex held
+   * @details within one Logger::dispatch every appender sharing a formatter
+   *          gets the bytes rendered by the first of them, the result is
+   *          valid until the calling thread logs again
+   */
+  const LogStream& render(Logger* logger, LogLevel::Level level, const LogEvent& event);
 
 protected:
   MUTEXTYPE           m_mutex;
   bool                m_hasFormatter {false};
-  LogLevel::Level     m_level {LogLevel::DEBUG};
+  std::atomic<LogLevel::Level>  m_level {LogLevel::DEBUG};
   LogFormatter::spLF  m_formatter;
 };
 
 class Logger : public std::enable_shared_from_this<Logger> {
   friend class LoggerManager;
+  friend class LogPipeline;
 public:
   using spLOGGER = std::shared_ptr<Logger>;
   using MUTEXTYPE = Spinlock;
@@ -336,6 +861,7 @@ public:
    * @brief cosntructor logger
    */
   Logger(const std::string& name = "root");
+  ~Logger();
   /**
    * @brief do log
    * @param[in] level
@@ -382,13 +908,47 @@ public:
    */
   void clearAppenders();
   /**
-   * @brief return level
+   * @brief return snapshot of appenders
    */
-  LogLevel::Level getLevel() const { return m_level; }
+  std::vector<LogAppender::spLA> getAppenders();
   /**
-   * @brief set level
+   * @brief replace all appenders at once
+   * @details writers see the old or the new list, never an empty one between
+   */
+  void setAppenders(const std::vector<LogAppender::spLA>& appenders);
+  /**
+   * @brief return configured level, UNKONWN inherits from the parent
+   */
+  LogLevel::Level getLevel() const { return m_level.load(std::memory_order_relaxed); }
+  /**
+   * @brief set level, UNKONWN inherits from the parent
+   * @details invalidates the cached effective level of every logger
    */
-  void setLevel(LogLevel::Level val) { m_level = val; }
+  void setLevel(LogLevel::Level val);
+  /**
+   * @brief return level in effect, the first level set on the way to root
+   */
+  LogLevel::Level getEffectiveLevel();
+  /**
+   * @brief return true if level passes the effective level
+   * @details a disabled level costs one relaxed load while the cache is valid
+   */
+  bool isEnabled(LogLevel::Level level) {
+    uint64_t e = m_effective.load(std::memory_order_relaxed);
+    LogLevel::Level effective = (LogLevel::Level)(e & 0xff);
+    if(level < effective) {
+      return false;
+    }
+    if(effective != LogLevel::UNKONWN
+        && (e >> 8) == s_levelGeneration.load(std::memory_order_relaxed)) {
+      return true;
+    }
+    return level >= refreshEffectiveLevel();
+  }
+  /**
+   * @brief return parent logger, null for root
+   */
+  Logger::spLOGGER getParent() const { return m_parent; }
   /**
    * @brief return log name
    */
@@ -413,42 +973,550 @@ public:
   std::string toYamlString();
 
 private:
+  using AppenderList = std::vector<LogAppender::spLA>;
+
+  /**
+   * @brief hand event to every appender
+   * @details lock free, walks the published appender snapshot
+   * @param[in] level
+   * @param[in] event
+   */
+  void dispatch(LogLevel::Level level, const LogEvent::spLE& event);
+  /**
+   * @brief publish list as the new appender snapshot, m_mutex held
+   * @return list it replaces, to be retired once m_mutex is released
+   */
+  AppenderList* publishAppenders(AppenderList* list);
+  /**
+   * @brief recompute and cache the effective level
+   */
+  LogLevel::Level refreshEffectiveLevel();
+
+private:
+  //bumped by every setLevel, cached effective levels of older generations are stale
+  static std::atomic<uint64_t>  s_levelGeneration;
+
   std::string                   m_name;
-  LogLevel::Level               m_level;
+  std::atomic<LogLevel::Level>  m_level {LogLevel::UNKONWN};
+  //generation << 8 | effective level, level UNKONWN means not computed
+  std::atomic<uint64_t>         m_effective {0};
+  //serializes writers, readers only load m_appenders
   MUTEXTYPE                     m_mutex;
-  std::list<LogAppender::spLA>  m_appenders;
+  //immutable snapshot, replaced on every change
+  std::atomic<AppenderList*>    m_appenders {nullptr};
   LogFormatter::spLF            m_formatter;
-  Logger::spLOGGER              m_root;
+  //nearest ancestor by name, "a.b" for "a.b.c", root for top level names
+  Logger::spLOGGER              m_parent;
+};
+
+/**
+ * @brief batching writer on a raw file descriptor
+ * @details records are copied into fixed size chunks and leave with one
+ *          writev per batch, a batch is written once it holds max_bytes or
+ *          at the latest max_delay_ms after its first record; thread safe
+ */
+class LogFdWriter : Noncopyable {
+public:
+  static const size_t CHUNK_SIZE = 64 * 1024;
+
+  LogFdWriter(int fd = -1);
+  ~LogFdWriter();
+
+  /**
+   * @brief switch to fd, queued data goes to the old one first
+   * @return old fd, the caller closes it
+   */
+  int setFd(int fd);
+  /**
+   * @brief return fd
+   */
+  int getFd() const { return m_fd; }
+  /**
+   * @brief set batch bounds
+   * @param[in] max_bytes queued bytes which trigger a write, 0 writes each record at once
+   * @param[in] max_delay_ms longest time a record stays queued
+   */
+  void setBatch(size_t max_bytes, uint32_t max_delay_ms);
+  /**
+   * @brief return queued bytes which trigger a write
+   */
+  size_t getBatchSize() const { return m_maxBytes; }
+  /**
+   * @brief return longest time a record stays queued
+   */
+  uint32_t getBatchDelay() const { return m_maxDelay; }
+  /**
+   * @brief queue data, write the batch once it is full
+   * @return false if a write failed
+   */
+  bool append(const char* data, size_t len);
+  /**
+   * @brief write the batch, then iov, with as few syscalls as possible
+   * @details iov is modified while partial writes are resumed
+   * @return false if a write failed
+   */
+  bool write(struct iovec* iov, int count);
+  /**
+   * @brief write the batch
+   * @return false if a write failed
+   */
+  bool flush();
+  /**
+   * @brief write the batch with write(2) only, for LogCrash callbacks
+   * @return fd, -1 if there is none
+   */
+  int emergencyFlush();
+
+  /**
+   * @brief writev all of iov, resuming partial writes and EINTR
+   * @return false on any other error
+   */
+  static bool WriteAll(int fd, struct iovec* iov, int count);
+
+private:
+  /**
+   * @brief write the batch followed by iov
+   * @pre m_mutex held
+   */
+  bool flushLocked(struct iovec* iov = nullptr, int count = 0);
+
+private:
+  std::mutex                m_mutex;
+  int                       m_fd;
+  size_t                    m_maxBytes {0};
+  uint32_t                  m_maxDelay {0};
+  uint64_t                  m_timerId {0};
+  /// @brief queued bytes, spread over m_chunks[0, m_used)
+  size_t                    m_bytes {0};
+  size_t                    m_used {0};
+  std::vector<std::string>  m_chunks;
+  std::vector<struct iovec> m_iov;
 };
+
 /**
  * @brief output to the console
  */
 class StdoutLogAppender : public LogAppender {
 public:
   using spSA = std::shared_ptr<StdoutLogAppender>;
-  void log(std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::spLE event) override;
+  StdoutLogAppender();
+  ~StdoutLogAppender();
+  void log(Logger* logger, LogLevel::Level level, const LogEvent::spLE& event) override;
   std::string toYamlString() override;
+  /**
+   * @brief set output batching, see LogFdWriter::setBatch
+   */
+  void setBatch(size_t max_bytes, uint32_t max_delay_ms) { m_writer.setBatch(max_bytes, max_delay_ms); }
+  /**
+   * @brief write queued records
+   */
+  void flush() { m_writer.flush(); }
+
+private:
+  /**
+   * @brief LogCrash callback
+   */
+  static int EmergencyFlush(void* arg);
+
+private:
+  LogFdWriter m_writer;
+  int         m_crashSlot {-1};
+};
+
+/**
+ * @brief background thread for log file upkeep
+ * @details runs periodic timers (external move checks, flushes) and one-shot
+ *          tasks (compression of rotated files) off the writer threads
+ */
+class LogHousekeeper : Noncopyable {
+public:
+  LogHousekeeper();
+  ~LogHousekeeper();
+
+  /**
+   * @brief run cb every interval_ms until it returns false
+   * @return timer id
+   */
+  uint64_t addTimer(uint32_t interval_ms, std::function<bool()> cb);
+  /**
+   * @brief remove timer, waits if its callback is running
+   */
+  void delTimer(uint64_t id);
+  /**
+   * @brief run task once on the background thread
+   */
+  void post(std::function<void()> task);
+
+private:
+  /**
+   * @brief background thread main loop
+   */
+  void run();
+
+private:
+  struct Timer {
+    uint32_t              interval;
+    uint64_t              next;
+    std::function<bool()> cb;
+  };
+
+  std::mutex                        m_mutex;
+  std::condition_variable           m_cond;
+  std::map<uint64_t, Timer>         m_timers;
+  std::list<std::function<void()>>  m_tasks;
+  uint64_t                          m_nextId {1};
+  uint64_t                          m_runningId {0};
+  bool                              m_stopping {false};
+  std::thread                       m_thread;
+};
+
+using sLOGHOUSEKEEPER = loongserver::Singleton<LogHousekeeper>;
+
+/**
+ * @brief last chance flush of buffered logs when the process dies
+ * @details on SIGSEGV, SIGBUS, SIGFPE, SIGILL and SIGABRT every registered
+ *          flush callback writes its buffers out with write(2), the report
+ *          (signal, thread, fiber, backtrace) goes to stderr and to each fd
+ *          the callbacks return, then the signal is raised again with the
+ *          action that was installed before. Everything on that path is
+ *          async-signal-safe, callbacks must be too.
+ */
+class LogCrash {
+public:
+  /**
+   * @brief flush callback, returns fd the report is appended to or -1
+   */
+  using FlushFunc = int (*)(void* arg);
+
+  static const size_t MAX_SLOTS = 64;
+
+  /**
+   * @brief install signal handlers and an alternate stack for the caller
+   * @details idempotent, called by LoggerManager::init
+   */
+  static void Install();
+  /**
+   * @brief give the calling thread an alternate signal stack
+   * @details without one a stack overflow of that thread cannot be reported,
+   *          threads started by loongserver call it themselves
+   */
+  static void InstallAltStack();
+  /**
+   * @brief register flush callback
+   * @return slot id for Unregister, -1 if all slots are taken
+   */
+  static int Register(FlushFunc func, void* arg);
+  /**
+   * @brief remove flush callback, never returns while a crash is reported
+   */
+  static void Unregister(int slot);
+  /**
+   * @brief write unflushed bytes of a stdio stream with write(2)
+   * @details async-signal-safe on glibc, does nothing elsewhere
+   */
+  static void DrainFile(FILE* file);
+  /**
+   * @brief dispatch queued records, then abort()
+   * @details used by LOONGSERVER_ASSERT, not async-signal-safe
+   */
+  [[noreturn]] static void Abort();
 };
 
+/**
+ * @brief per call site rate limit / sampling state
+ * @details pass() is one or two atomic operations, sites which suppressed
+ *          records register with LogHousekeeper so that a quiet site still
+ *          reports its count
+ */
+class LogLimiter : Noncopyable {
+public:
+  enum Policy {
+    /** a: tokens per second, b: bucket size */
+    TOKEN_BUCKET,
+    /** a: keep 1 of every a */
+    EVERY_N,
+    /** a: keep the first a, b: then every b-th */
+    FIRST_N_EVERY_M,
+  };
+
+  /// @brief interval of suppressed summaries
+  static const uint32_t REPORT_INTERVAL_MS = 10 * 1000;
+
+  LogLimiter(Policy policy, uint64_t a, uint64_t b, LogLevel::Level level
+             ,const char* file, int32_t line);
+  ~LogLimiter();
+
+  /**
+   * @brief decide on one record
+   * @return 0 suppressed, otherwise 1 + records suppressed since the last report
+   */
+  uint64_t pass(const std::shared_ptr<Logger>& logger);
+
+  /**
+   * @brief write a summary of the suppressed records, if any
+   */
+  void report();
+
+private:
+  bool take();
+  void suppress(const std::shared_ptr<Logger>& logger);
+
+private:
+  Policy                    m_policy;
+  uint64_t                  m_a;
+  uint64_t                  m_b;
+  LogLevel::Level           m_level;
+  const char*               m_file;
+  int32_t                   m_line;
+  //TOKEN_BUCKET: ms since process start << 24 | tokens in 1/1000 units
+  //others: records seen
+  std::atomic<uint64_t>     m_state {0};
+  std::atomic<uint64_t>     m_suppressed {0};
+  std::atomic<bool>         m_registered {false};
+  std::shared_ptr<Logger>   m_logger;
+};
+
+/**
+ * @brief prefix of the first record after suppressed ones
+ */
+struct LogSuppressed {
+  uint64_t count;
+  /// @brief the record itself is suppressed
+  bool blocked;
+
+  /**
+   * @brief convert the result of LogLimiter::pass
+   */
+  static LogSuppressed FromPass(uint64_t pass) {
+    return LogSuppressed{pass ? pass - 1 : 0, pass == 0};
+  }
+
+  /**
+   * @brief true if the record is suppressed
+   */
+  explicit operator bool() const { return blocked; }
+};
+
+inline LogStream& operator<<(LogStream& os, const LogSuppressed& v) {
+  if(v.count) {
+    os << "[suppressed " << v.count << "] ";
+  }
+  return os;
+}
+
 /**
  * @brief output to the file
+ * @details the file is rotated by size and/or wall-clock interval, rotated
+ *          files are named filename.YYYYmmdd-HHMMSS, optionally gzip'ed in
+ *          the background, and only the newest max_files are kept. A
+ *          background check reopens the file once it is moved away.
+ * @details in async mode producers only copy the formatted line into a
+ *          pre-allocated front buffer; full buffers are swapped out and
+ *          written by a dedicated flusher thread
  */
 class FileLogAppender : public LogAppender {
 public:
   using spFA = std::shared_ptr<FileLogAppender>;
   FileLogAppender(const std::string& filename);
-  void log(std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::spLE event) override;
+  ~FileLogAppender();
+  void log(Logger* logger, LogLevel::Level level, const LogEvent::spLE& event) override;
   std::string toYamlString() override;
   /**
    * @brief reopen log file
    * @return success -> true
    */
   bool reopen();
+  /**
+   * @brief configure rotation
+   * @param[in] max_size rotate once the file reaches it, 0 disables
+   * @param[in] interval_sec rotate on local time multiples of it, 0 disables
+   * @param[in] max_files rotated files kept, 0 keeps all
+   * @param[in] compress gzip rotated files
+   */
+  void setRotation(uint64_t max_size, uint32_t interval_sec, uint32_t max_files, bool compress);
+  /**
+   * @brief return log file name
+   */
+  const std::string& getFilename() const { return m_filename; }
+  /**
+   * @brief switch async mode on or off
+   * @param[in] flush_interval_ms longest time a line stays in memory
+   * @param[in] high_water buffered bytes which wake the flusher early
+   */
+  void setAsync(bool val, uint32_t flush_interval_ms = 1000, uint64_t high_water = 512 * 1024);
+  /**
+   * @brief set output batching of synchronous writes, see LogFdWriter::setBatch
+   */
+  void setBatch(size_t max_bytes, uint32_t max_delay_ms) { m_writer.setBatch(max_bytes, max_delay_ms); }
+  /**
+   * @brief write queued records
+   */
+  void flush() { m_writer.flush(); }
+  /**
+   * @brief return true if async mode is on
+   */
+  bool isAsync() const { return m_async; }
+  /**
+   * @brief return lines dropped because the flusher fell behind
+   */
+  uint64_t getDropped() const { return m_dropped; }
+
+private:
+  /**
+   * @brief append formatted line into the front buffer
+   */
+  void appendAsync(const char* data, size_t len);
+  /**
+   * @brief flusher thread main loop
+   */
+  void flushLoop();
+  /**
+   * @brief write buffers to the file, called by the flusher only
+   */
+  void writeBuffers(std::vector<std::string>& bufs);
+  /**
+   * @brief return true if len more bytes need a rotation or reopen first
+   * @pre m_mutex held
+   */
+  bool needPrepareLocked(size_t len) const;
+  /**
+   * @brief rotate or reopen the file if len more bytes call for it
+   * @pre m_mutex held
+   */
+  void prepareLocked(size_t len);
+  /**
+   * @brief write to the file, rotate or reopen first if needed
+   * @pre m_mutex held
+   */
+  void writeLocked(const char* data, size_t len);
+  /**
+   * @brief reopen log file
+   * @pre m_mutex held
+   */
+  bool reopenLocked();
+  /**
+   * @brief move current file aside and open a new one
+   * @pre m_mutex held
+   */
+  void rotateLocked(uint64_t now);
+  /**
+   * @brief compute next interval rotation time after now
+   */
+  uint64_t nextRotateTime(uint64_t now) const;
+  /**
+   * @brief detect the file being moved or removed, runs on LogHousekeeper
+   */
+  void checkFile();
+  /**
+   * @brief LogCrash callback, writes queued and async buffered lines
+   */
+  static int EmergencyFlush(void* arg);
 
 private:
   std::string m_filename;
-  std::ofstream m_filestream;
-  uint64_t m_lastTime = 0;
+  LogFdWriter m_writer;
+
+  /// @brief rotation state, guarded by m_mutex
+  uint64_t                  m_maxSize {0};
+  uint32_t                  m_rotateInterval {0};
+  uint32_t                  m_maxFiles {0};
+  bool                      m_compress {false};
+  uint64_t                  m_fileSize {0};
+  uint64_t                  m_nextRotate {0};
+  /// @brief identity of the open file, compared by checkFile()
+  std::atomic<uint64_t>     m_dev {0};
+  std::atomic<uint64_t>     m_ino {0};
+  std::atomic<bool>         m_reopenPending {false};
+  uint64_t                  m_watchId {0};
+  int                       m_crashSlot {-1};
+
+  /// @brief async mode state, guarded by m_bufMutex
+  std::atomic<bool>         m_async {false};
+  bool                      m_running {false};
+  uint32_t                  m_flushInterval {1000};
+  uint64_t                  m_highWater {512 * 1024};
+  uint64_t                  m_pendingBytes {0};
+  std::atomic<uint64_t>     m_dropped {0};
+  std::string               m_front;
+  std::vector<std::string>  m_pending;
+  std::vector<std::string>  m_spares;
+  std::mutex                m_bufMutex;
+  std::condition_variable   m_bufCond;
+  std::thread               m_flusher;
+};
+
+/**
+ * @brief output to a memory-mapped file
+ * @details the file grows in fallocate'd chunks which are mapped in turn;
+ *          producers reserve their range with an atomic fetch-add on the
+ *          write position and memcpy the line into the mapping, a line
+ *          crossing a chunk boundary is split over both chunks. A chunk is
+ *          unmapped by whoever writes its last byte. Unused space is cut off
+ *          when the appender is destroyed.
+ */
+class MmapFileLogAppender : public LogAppender {
+public:
+  using spMA = std::shared_ptr<MmapFileLogAppender>;
+  /**
+   * @brief constructor
+   * @param[in] filename
+   * @param[in] chunk_size bytes allocated and mapped at a time, multiple of page size
+   * @param[in] sync_interval_ms period of msync, 0 leaves it to the kernel
+   */
+  MmapFileLogAppender(const std::string& filename, size_t chunk_size = 32 * 1024 * 1024
+                      ,uint32_t sync_interval_ms = 1000);
+  ~MmapFileLogAppender();
+  void log(Logger* logger, LogLevel::Level level, const LogEvent::spLE& event) override;
+  std::string toYamlString() override;
+  /**
+   * @brief schedule write back of mapped chunks
+   */
+  void sync();
+  /**
+   * @brief return log file name
+   */
+  const std::string& getFilename() const { return m_filename; }
+
+private:
+  /**
+   * @brief copy data to the file range starting at pos
+   */
+  void write(const char* data, size_t len);
+  /**
+   * @brief return mapping of chunk index, map it if needed
+   * @return nullptr if the chunk could not be allocated or mapped, the
+   *         bytes meant for it are dropped but still released
+   */
+  char* acquireChunk(uint64_t index);
+  /**
+   * @brief map chunk_size bytes of the file at offset, nullptr on failure
+   */
+  char* mapChunk(off_t offset);
+  /**
+   * @brief account len bytes written into chunk index, unmap it once full
+   */
+  void releaseChunk(uint64_t index, size_t len);
+
+private:
+  static const uint64_t NO_CHUNK = ~0ull;
+  static const size_t CHUNK_SLOTS = 4;
+
+  struct Chunk {
+    std::atomic<uint64_t> index {NO_CHUNK};
+    std::atomic<char*>    base {nullptr};
+    std::atomic<uint64_t> written {0};
+  };
+
+  std::string             m_filename;
+  int                     m_fd {-1};
+  size_t                  m_chunkSize;
+  uint32_t                m_syncInterval;
+  /// @brief end of valid data when the file was opened
+  uint64_t                m_startPos {0};
+  std::atomic<uint64_t>   m_writePos {0};
+  std::mutex              m_mapMutex;
+  Chunk                   m_chunks[CHUNK_SLOTS];
+  uint64_t                m_syncId {0};
 };
 
 class LoggerManager {
@@ -457,10 +1525,15 @@ public:
 
   LoggerManager();
   /**
-   * @brief get logger
-   * @param[in] string name of logger
+   * @brief get logger, creating it and its missing ancestors
+   * @param[in] string name of logger, levels separated by '.'
    */
-  Logger::spLOGGER getLogger(const std::string& name);
+  Logger::spLOGGER getLogger(const std::string& name) { return getLogger(name.data(), name.size()); }
+  Logger::spLOGGER getLogger(const char* name) { return getLogger(name, strlen(name)); }
+  /**
+   * @brief get logger, existing loggers are found without locking
+   */
+  Logger::spLOGGER getLogger(const char* name, size_t len);
   /**
    * @brief init
    */
@@ -475,12 +1548,188 @@ public:
   std::string toYamlString();
 
 private:
+  struct LoggerTable;
+
+  /**
+   * @brief create logger and its missing ancestors
+   */
+  Logger::spLOGGER createLogger(const std::string& name);
+  /**
+   * @brief build lookup table from m_loggers, m_mutex held
+   * @return table it replaces, to be retired once m_mutex is released
+   */
+  LoggerTable* publishTable();
+
+private:
+  //serializes creation, readers only load m_table
   MUTEXTYPE                               m_mutex;
   std::map<std::string, Logger::spLOGGER> m_loggers;
   Logger::spLOGGER                        m_root;
+  //open addressing snapshot of m_loggers, replaced on every creation
+  std::atomic<LoggerTable*>               m_table {nullptr};
 };
 
 using sLOGGERMGR = loongserver::Singleton<LoggerManager>;
 
+/**
+ * @brief single producer single consumer ring of pending log records
+ * @details the owning thread pushes without locks; pops are serialized by a
+ *          spinlock so the producer can discard the oldest record on overflow
+ */
+class LogRing {
+public:
+  using spLR = std::shared_ptr<LogRing>;
+  using MUTEXTYPE = Spinlock;
+
+  struct Record {
+    /// @brief event creation time, GetMonotonicNS
+    uint64_t          ts {0};
+    Logger::spLOGGER  logger;
+    LogLevel::Level   level {LogLevel::UNKONWN};
+    LogEvent::spLE    event;
+  };
+
+  /**
+   * @brief constructor
+   * @param[in] capacity rounded up to a power of two
+   */
+  LogRing(size_t capacity);
+  /**
+   * @brief producer side, false if the ring is full
+   */
+  bool push(Record&& r);
+  /**
+   * @brief consumer side, false if the ring is empty
+   */
+  bool pop(Record& r);
+  /**
+   * @brief return true if there is nothing to pop
+   */
+  bool empty() const;
+  /**
+   * @brief return true if push would fail
+   */
+  bool full() const;
+  /**
+   * @brief mark the owning thread as gone
+   */
+  void close() { m_closed = true; }
+  /**
+   * @brief return true if the owning thread exited
+   */
+  bool isClosed() const { return m_closed; }
+
+private:
+  std::vector<Record>   m_slots;
+  size_t                m_mask;
+  MUTEXTYPE             m_popMutex;
+  std::atomic<bool>     m_closed {false};
+  /// @brief next slot to pop, written under m_popMutex
+  alignas(64) std::atomic<size_t> m_head {0};
+  /// @brief next slot to push, written by the producer only
+  alignas(64) std::atomic<size_t> m_tail {0};
+};
+
+/**
+ * @brief asynchronous log pipeline
+ * @details every logging thread (and all fibers hosted on it) owns a LogRing,
+ *          a single backend thread merges the rings in timestamp order and
+ *          dispatches the records to the appenders of their loggers
+ */
+class LogPipeline {
+public:
+  using MUTEXTYPE = Spinlock;
+
+  /**
+   * @brief what a producer does when its ring is full
+   */
+  enum OverflowPolicy {
+    /** wait until the backend makes room */
+    BLOCK = 0,
+    /** discard the record being logged */
+    DROP_NEWEST = 1,
+    /** discard the oldest queued record */
+    DROP_OLDEST = 2,
+  };
+
+  LogPipeline();
+  ~LogPipeline();
+
+  /**
+   * @brief start backend thread
+   */
+  void start();
+  /**
+   * @brief drain all rings and stop backend thread
+   */
+  void stop();
+  /**
+   * @brief dispatch what is queued now, callable from any thread
+   * @details waits for a batch the backend is dispatching, the records stay
+   *          in timestamp order
+   */
+  void flush();
+  /**
+   * @brief return true if backend thread is running
+   */
+  bool isRunning() const { return m_running.load(std::memory_order_relaxed); }
+  /**
+   * @brief queue record into the ring of the calling thread
+   * @return false if the caller must dispatch the record itself
+   */
+  bool enqueue(Logger::spLOGGER logger, LogLevel::Level level, LogEvent::spLE event);
+  /**
+   * @brief set overflow policy
+   */
+  void setOverflowPolicy(OverflowPolicy val) { m_policy = val; }
+  /**
+   * @brief return overflow policy
+   */
+  OverflowPolicy getOverflowPolicy() const { return m_policy; }
+  /**
+   * @brief set capacity of rings created from now on
+   */
+  void setRingCapacity(size_t val) { m_capacity = val; }
+  /**
+   * @brief return records dropped since start
+   */
+  uint64_t getDropped() const { return m_dropped; }
+
+private:
+  /**
+   * @brief return ring of the calling thread, create it on first use
+   */
+  LogRing* getThreadRing();
+  /**
+   * @brief drain rings once
+   * @return number of dispatched records
+   */
+  size_t drain();
+  /**
+   * @brief backend thread main loop
+   */
+  void run();
+
+private:
+  MUTEXTYPE                         m_mutex;
+  std::vector<LogRing::spLR>        m_rings;
+  std::atomic<bool>                 m_running {false};
+  std::atomic<bool>                 m_sleeping {false};
+  std::atomic<OverflowPolicy>       m_policy {BLOCK};
+  std::atomic<size_t>               m_capacity {8192};
+  std::atomic<uint64_t>             m_dropped {0};
+  std::mutex                        m_sleepMutex;
+  std::condition_variable           m_sleepCond;
+  /// @brief BLOCK producers waiting for room in their ring
+  std::atomic<uint32_t>             m_blocked {0};
+  std::mutex                        m_spaceMutex;
+  std::condition_variable           m_spaceCond;
+  /// @brief held by drain(), the backend and flush() never merge at once
+  std::mutex                        m_drainMutex;
+  std::thread                       m_thread;
+};
+
+using sLOGPIPELINE = loongserver::Singleton<LogPipeline>;
+
 }
 #endif
\ No newline at end of file
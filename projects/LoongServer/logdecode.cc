@@ -0,0 +1,305 @@
+#include "binlog.h"
+
+#include <map>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+
+/**
+ * @brief loongserver-logdecode: turn binary log streams back into text
+ * @details usage: loongserver-logdecode [-p pattern] [file...]
+ *          reads stdin when no file is given, pattern is a LogFormatter
+ *          pattern, or json, and defaults to the Logger default pattern
+ */
+
+namespace {
+  using loongserver::BinLogFormat;
+
+  //streams written before events carried their elapse
+  const char* s_magic_v1 = "LSBINLOG1\n";
+
+  struct Site {
+    loongserver::LogLevel::Level  level;
+    int32_t                       line;
+    std::string                   file;
+    std::string                   fmt;
+    loongserver::Logger::spLOGGER logger;
+    std::vector<uint8_t>          args;
+  };
+
+  /**
+   * @brief bounds checked reader over one record body
+   */
+  class Reader {
+  public:
+    Reader(const std::string& body) : m_pos(body.data()), m_end(body.data() + body.size()) {}
+
+    template<class T>
+    bool get(T& v) {
+      if(m_end - m_pos < (ptrdiff_t)sizeof(T)) {
+        return false;
+      }
+      memcpy(&v, m_pos, sizeof(T));
+      m_pos += sizeof(T);
+      return true;
+    }
+
+    template<class L>
+    bool getString(std::string& v) {
+      L len;
+      if(!get(len) || m_end - m_pos < (ptrdiff_t)len) {
+        return false;
+      }
+      v.assign(m_pos, len);
+      m_pos += len;
+      return true;
+    }
+
+  private:
+    const char* m_pos;
+    const char* m_end;
+  };
+
+  void AppendPrintf(loongserver::LogStream& out, const char* fmt, ...) {
+    va_list al;
+    va_start(al, fmt);
+    out.appendFormat(fmt, al);
+    va_end(al);
+  }
+
+  /**
+   * @brief render fmt with the stored arguments, the stored type decides
+   *        the C type passed to printf so length modifiers are rewritten
+   */
+  bool RenderMessage(loongserver::LogStream& out, const Site& site, Reader& r) {
+    const std::string& fmt = site.fmt;
+    size_t arg = 0;
+    for(size_t i = 0; i < fmt.size(); ++i) {
+      if(fmt[i] != '%') {
+        size_t n = fmt.find('%', i);
+        n = (n == std::string::npos ? fmt.size() : n);
+        out.append(fmt.data() + i, n - i);
+        i = n - 1;
+        continue;
+      }
+      if(i + 1 < fmt.size() && fmt[i + 1] == '%') {
+        out.append("%", 1);
+        ++i;
+        continue;
+      }
+
+      std::string spec = "%";
+      size_t j = i + 1;
+      while(j < fmt.size() && strchr("-+ #0", fmt[j])) {
+        spec += fmt[j++];
+      }
+      while(j < fmt.size() && (isdigit(fmt[j]) || fmt[j] == '.')) {
+        spec += fmt[j++];
+      }
+      while(j < fmt.size() && strchr("hlLqjzt", fmt[j])) {
+        ++j;
+      }
+      if(j >= fmt.size() || arg >= site.args.size()) {
+        out.append(fmt.data() + i, fmt.size() - i);
+        break;
+      }
+
+      char conv = fmt[j];
+      switch(site.args[arg++]) {
+        case BinLogFormat::INT: {
+          int64_t v;
+          if(!r.get(v)) {
+            return false;
+          }
+          if(conv == 'c') {
+            AppendPrintf(out, (spec + "c").c_str(), (int)v);
+          }else if(strchr("diouxX", conv)) {
+            AppendPrintf(out, (spec + "ll" + conv).c_str(), (long long)v);
+          }else {
+            AppendPrintf(out, "%lld", (long long)v);
+          }
+          break;
+        }
+        case BinLogFormat::UINT: {
+          uint64_t v;
+          if(!r.get(v)) {
+            return false;
+          }
+          if(conv == 'c') {
+            AppendPrintf(out, (spec + "c").c_str(), (int)v);
+          }else if(strchr("diouxX", conv)) {
+            AppendPrintf(out, (spec + "ll" + conv).c_str(), (unsigned long long)v);
+          }else {
+            AppendPrintf(out, "%llu", (unsigned long long)v);
+          }
+          break;
+        }
+        case BinLogFormat::DOUBLE: {
+          double v;
+          if(!r.get(v)) {
+            return false;
+          }
+          AppendPrintf(out, strchr("eEfFgGaA", conv) ? (spec + conv).c_str() : "%g", v);
+          break;
+        }
+        case BinLogFormat::STRING: {
+          std::string v;
+          if(!r.getString<uint32_t>(v)) {
+            return false;
+          }
+          AppendPrintf(out, conv == 's' ? (spec + "s").c_str() : "%s", v.c_str());
+          break;
+        }
+        case BinLogFormat::POINTER: {
+          uint64_t v;
+          if(!r.get(v)) {
+            return false;
+          }
+          AppendPrintf(out, "%p", (void*)(uintptr_t)v);
+          break;
+        }
+        default:
+          return false;
+      }
+      i = j;
+    }
+    return true;
+  }
+
+  bool ReadSite(const std::string& body, std::map<uint32_t, Site>& sites
+                ,std::map<std::string, loongserver::Logger::spLOGGER>& loggers) {
+    Reader r(body);
+    uint32_t id;
+    uint8_t level;
+    uint8_t count;
+    Site site;
+    std::string logger;
+    if(!r.get(id) || !r.get(level) || !r.get(site.line)
+        || !r.getString<uint16_t>(site.file) || !r.getString<uint16_t>(site.fmt)
+        || !r.getString<uint16_t>(logger) || !r.get(count)) {
+      return false;
+    }
+    site.args.resize(count);
+    for(auto& i : site.args) {
+      if(!r.get(i)) {
+        return false;
+      }
+    }
+    site.level = (loongserver::LogLevel::Level)level;
+
+    auto& l = loggers[logger];
+    if(!l) {
+      l = std::make_shared<loongserver::Logger>(logger);
+    }
+    site.logger = l;
+    sites[id] = std::move(site);
+    return true;
+  }
+
+  bool ReadEvent(const std::string& body, const std::map<uint32_t, Site>& sites, bool has_elapse
+                 ,loongserver::LogFormatter& formatter, loongserver::LogStream& out) {
+    Reader r(body);
+    uint32_t id;
+    uint64_t time;
+    uint64_t elapse = 0;
+    uint32_t thread_id;
+    uint32_t fiber_id;
+    if(!r.get(id) || !r.get(time) || (has_elapse && !r.get(elapse))
+        || !r.get(thread_id) || !r.get(fiber_id)) {
+      return false;
+    }
+    auto it = sites.find(id);
+    if(it == sites.end()) {
+      return false;
+    }
+    const Site& site = it->second;
+
+    auto event = loongserver::LogEvent::Create(site.logger, site.level, site.file.c_str(), site.line
+                    ,elapse, thread_id, fiber_id, time, loongserver::Thread::UNKNOWN_NAME_ID);
+    if(!RenderMessage(event->getSS(), site, r)) {
+      return false;
+    }
+    out.clear();
+    formatter.format(out, site.logger.get(), site.level, *event);
+    fwrite(out.data(), 1, out.size(), stdout);
+    return true;
+  }
+
+  int DecodeFile(FILE* file, const char* name, loongserver::LogFormatter& formatter) {
+    char magic[BinLogFormat::MAGIC_SIZE];
+    if(fread(magic, 1, sizeof(magic), file) != sizeof(magic)
+        || (memcmp(magic, BinLogFormat::MAGIC, sizeof(magic)) != 0
+            && memcmp(magic, s_magic_v1, sizeof(magic)) != 0)) {
+      fprintf(stderr, "%s: not a binary log stream\n", name);
+      return 1;
+    }
+    bool has_elapse = memcmp(magic, s_magic_v1, sizeof(magic)) != 0;
+
+    std::map<uint32_t, Site> sites;
+    std::map<std::string, loongserver::Logger::spLOGGER> loggers;
+    loongserver::LogStream out;
+    std::string body;
+    uint64_t bad = 0;
+    char head[5];
+    while(fread(head, 1, sizeof(head), file) == sizeof(head)) {
+      uint32_t len;
+      memcpy(&len, head + 1, sizeof(len));
+      body.resize(len);
+      if(len && fread(&body[0], 1, len, file) != len) {
+        fprintf(stderr, "%s: truncated record\n", name);
+        break;
+      }
+
+      bool ok = true;
+      if(head[0] == BinLogFormat::SITE) {
+        ok = ReadSite(body, sites, loggers);
+      }else if(head[0] == BinLogFormat::EVENT) {
+        ok = ReadEvent(body, sites, has_elapse, formatter, out);
+      }
+      if(!ok) {
+        ++bad;
+      }
+    }
+    if(bad) {
+      fprintf(stderr, "%s: %llu records could not be decoded\n", name, (unsigned long long)bad);
+    }
+    return bad ? 1 : 0;
+  }
+}
+
+int main(int argc, char** argv) {
+  std::string pattern = "%d{%Y-%m-%d %H:%M:%S}%T%t%T%N%T%F%T[%p]%T[%c]%T%f:%l%T%m%n";
+  int opt;
+  while((opt = getopt(argc, argv, "p:h")) != -1) {
+    switch(opt) {
+      case 'p':
+        pattern = optarg;
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-p pattern] [file...]\n", argv[0]);
+        return opt == 'h' ? 0 : 1;
+    }
+  }
+
+  loongserver::LogFormatter::spLF formatter = loongserver::LogFormatter::Create(pattern);
+  if(formatter->isError()) {
+    fprintf(stderr, "invalid pattern: %s\n", pattern.c_str());
+    return 1;
+  }
+
+  int rt = 0;
+  if(optind >= argc) {
+    rt = DecodeFile(stdin, "stdin", *formatter);
+  }
+  for(int i = optind; i < argc; ++i) {
+    FILE* file = fopen(argv[i], "rb");
+    if(!file) {
+      fprintf(stderr, "%s: cannot open\n", argv[i]);
+      rt = 1;
+      continue;
+    }
+    rt |= DecodeFile(file, argv[i], *formatter);
+    fclose(file);
+  }
+  return rt;
+}
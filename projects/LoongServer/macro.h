@@ -0,0 +1,49 @@
+#ifndef __LOONGSERVER_MACRO_H__
+#define __LOONGSERVER_MACRO_H__
+
+#include <string.h>
+#include <assert.h>
+
+#include "log.h"
+#include "util.h"
+
+#if defined __GNUC__ || defined __llvm__
+/// @brief tell the compiler x is most likely true
+#   define LOONGSERVER_LIKELY(x)     __builtin_expect(!!(x), 1)
+/// @brief tell the compiler x is most likely false
+#   define LOONGSERVER_UNLIKELY(x)   __builtin_expect(!!(x), 0)
+#else
+#   define LOONGSERVER_LIKELY(x)     (x)
+#   define LOONGSERVER_UNLIKELY(x)   (x)
+#endif
+
+/**
+ * @brief abort when x is false, after logging it with the call stack
+ * @details queued records are dispatched first and the SIGABRT handler of
+ *          LogCrash writes out what the appenders still buffer
+ */
+#define LOONGSERVER_ASSERT(x) \
+  do { \
+    if(LOONGSERVER_UNLIKELY(!(x))) { \
+      LOONGSERVER_LOG_ERROR(LOONGSERVER_LOG_ROOT()) << "ASSERTION: " #x \
+        << "\nbacktrace:\n" \
+        << loongserver::BacktraceToString(100, 2, "    "); \
+      loongserver::LogCrash::Abort(); \
+    } \
+  } while(0)
+
+/**
+ * @brief LOONGSERVER_ASSERT with an extra message w
+ */
+#define LOONGSERVER_ASSERT2(x, w) \
+  do { \
+    if(LOONGSERVER_UNLIKELY(!(x))) { \
+      LOONGSERVER_LOG_ERROR(LOONGSERVER_LOG_ROOT()) << "ASSERTION: " #x \
+        << "\n" << w \
+        << "\nbacktrace:\n" \
+        << loongserver::BacktraceToString(100, 2, "    "); \
+      loongserver::LogCrash::Abort(); \
+    } \
+  } while(0)
+
+#endif
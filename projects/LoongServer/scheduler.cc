@@ -0,0 +1,407 @@
+#include "scheduler.h"
+#include "log.h"
+#include "macro.h"
+#include "thread.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+namespace loongserver {
+
+  static Logger::spLOGGER g_logger = LOONGSERVER_LOG_NAME("system");
+
+  static thread_local Scheduler* t_scheduler = nullptr;
+  static thread_local Fiber* t_scheduler_fiber = nullptr;
+  static thread_local int t_worker = -1;
+
+  //every this many tasks a worker serves the shared queue before its own work
+  static const uint64_t s_injected_interval = 61;
+  //rounds over all victims before a worker gives up and parks
+  static const int s_steal_rounds = 2;
+
+  static void FutexWait(std::atomic<uint32_t>& word, uint32_t value) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAIT_PRIVATE
+            ,value, nullptr, nullptr, 0);
+  }
+
+  static void FutexWake(std::atomic<uint32_t>& word) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAKE_PRIVATE
+            ,1, nullptr, nullptr, 0);
+  }
+
+  //xorshift64, seeded per worker
+  static uint64_t NextRand(uint64_t& x) {
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return x;
+  }
+
+  Scheduler::Scheduler(size_t threads, bool use_caller, const std::string& name)
+    :m_name(name.empty() ? "scheduler" : name)
+    ,m_useCaller(use_caller) {
+    LOONGSERVER_ASSERT(threads > 0);
+    for(size_t i = 0; i < threads; ++i) {
+      m_workers.emplace_back(new Worker);
+    }
+
+    if(use_caller) {
+      Fiber::GetThis();
+      --threads;
+
+      LOONGSERVER_ASSERT(GetThis() == nullptr);
+      t_scheduler = this;
+      m_rootFiber.reset(new Fiber([this]() {
+        t_worker = 0;
+        run();
+        t_worker = -1;
+      }, 0, true));
+      Thread::SetName(m_name);
+
+      t_scheduler_fiber = m_rootFiber.get();
+      m_workers[0]->threadId = GetThreadId();
+    }
+    m_threadCount = threads;
+  }
+
+  Scheduler::~Scheduler() {
+    LOONGSERVER_ASSERT(m_stopping);
+    if(GetThis() == this) {
+      t_scheduler = nullptr;
+      t_scheduler_fiber = nullptr;
+    }
+    for(auto& i : m_workers) {
+      while(Task* task = i->deque.pop()) {
+        delete task;
+      }
+      for(auto task : i->inbox) {
+        delete task;
+      }
+    }
+    for(auto task : m_injected) {
+      delete task;
+    }
+  }
+
+  Scheduler* Scheduler::GetThis() {
+    return t_scheduler;
+  }
+
+  Fiber* Scheduler::GetMainFiber() {
+    return t_scheduler_fiber;
+  }
+
+  int Scheduler::GetWorkerIndex() {
+    return t_worker;
+  }
+
+  void Scheduler::setThis() {
+    t_scheduler = this;
+  }
+
+  void Scheduler::start() {
+    if(m_started) {
+      return;
+    }
+    m_started = true;
+    m_stopping = false;
+
+    std::vector<int> cpus;
+    if(m_pinThreads) {
+      cpu_set_t allowed;
+      CPU_ZERO(&allowed);
+      if(sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+        for(int i = 0; i < CPU_SETSIZE; ++i) {
+          if(CPU_ISSET(i, &allowed)) {
+            cpus.push_back(i);
+          }
+        }
+      }
+    }
+
+    size_t first = m_useCaller ? 1 : 0;
+    for(size_t i = 0; i < m_threadCount; ++i) {
+      int index = first + i;
+      int cpu = cpus.empty() ? -1 : cpus[index % cpus.size()];
+      m_threads.emplace_back([this, index, cpu]() {
+        Thread::SetName(m_name + "_" + std::to_string(index));
+        //before run(), the deque, pools and stacks are first touched on that cpu
+        if(cpu >= 0) {
+          cpu_set_t set;
+          CPU_ZERO(&set);
+          CPU_SET(cpu, &set);
+          int rt = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+          if(rt) {
+            LOONGSERVER_LOG_ERROR(g_logger) << "Scheduler " << m_name << " pin worker " << index
+                << " to cpu " << cpu << " failed: " << strerror(rt) << ", runs unpinned";
+          }
+        }
+        t_worker = index;
+        run();
+        t_worker = -1;
+      });
+    }
+  }
+
+  void Scheduler::stop() {
+    m_stopping = true;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    for(auto& i : m_workers) {
+      wake(*i);
+    }
+
+    if(m_rootFiber) {
+      LOONGSERVER_ASSERT2(GetThis() == this, "use_caller scheduler must be stopped on its caller thread");
+      if(!stopping()) {
+        m_rootFiber->call();
+      }
+    }else {
+      LOONGSERVER_ASSERT2(GetThis() != this, "scheduler can not be stopped from its own worker");
+    }
+
+    for(auto& i : m_threads) {
+      i.join();
+    }
+    m_threads.clear();
+  }
+
+  void Scheduler::push(Task* task) {
+    if(task->fiber && task->fiber->m_sharedStack) {
+      //its stack belongs to the thread which created it
+      task->thread = findWorker(task->fiber->m_stackThread);
+      LOONGSERVER_ASSERT2(task->thread >= 0, "shared stack fiber id=" << task->fiber->getId()
+          << " was not created by a worker of " << m_name);
+    }
+    LOONGSERVER_ASSERT(task->thread < (int)m_workers.size());
+    m_pending.fetch_add(1, std::memory_order_relaxed);
+
+    int self = (t_scheduler == this ? t_worker : -1);
+    if(task->thread >= 0) {
+      Worker& w = *m_workers[task->thread];
+      {
+        std::lock_guard<std::mutex> lock(w.inboxMutex);
+        w.inbox.push_back(task);
+        w.hasInbox.store(true, std::memory_order_relaxed);
+      }
+      if(task->thread != self) {
+        tickle(task->thread);
+      }
+      return;
+    }
+
+    if(self >= 0) {
+      m_workers[self]->deque.push(task);
+    }else {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_injected.push_back(task);
+      m_injectedSize.fetch_add(1, std::memory_order_relaxed);
+    }
+    tickle();
+  }
+
+  void Scheduler::tickle(int thread) {
+    //pairs with the fence idle() puts between marking parked and looking for work
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(thread >= 0) {
+      wake(*m_workers[thread]);
+      return;
+    }
+    //a worker still searching will find it, it wakes another when it does
+    if(m_parked.load(std::memory_order_relaxed) == 0
+        || m_searching.load(std::memory_order_relaxed) > 0) {
+      return;
+    }
+    size_t n = m_workers.size();
+    size_t start = t_worker >= 0 ? t_worker : GetThreadId();
+    for(size_t i = 0; i < n; ++i) {
+      if(wake(*m_workers[(start + i) % n])) {
+        return;
+      }
+    }
+  }
+
+  bool Scheduler::wake(Worker& w) {
+    bool parked = true;
+    if(!w.parked.compare_exchange_strong(parked, false)) {
+      return false;
+    }
+    w.parkSeq.fetch_add(1, std::memory_order_release);
+    FutexWake(w.parkSeq);
+    return true;
+  }
+
+  int Scheduler::findWorker(pid_t tid) const {
+    for(size_t i = 0; i < m_workers.size(); ++i) {
+      if(m_workers[i]->threadId.load(std::memory_order_relaxed) == tid) {
+        return i;
+      }
+    }
+    return -1;
+  }
+
+  Scheduler::Task* Scheduler::take(Worker& w) {
+    if(++w.tick % s_injected_interval == 0 && m_injectedSize.load(std::memory_order_relaxed)) {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if(!m_injected.empty()) {
+        Task* task = m_injected.front();
+        m_injected.pop_front();
+        m_injectedSize.fetch_sub(1, std::memory_order_relaxed);
+        return task;
+      }
+    }
+    if(w.hasInbox.load(std::memory_order_acquire)) {
+      std::lock_guard<std::mutex> lock(w.inboxMutex);
+      if(!w.inbox.empty()) {
+        Task* task = w.inbox.front();
+        w.inbox.pop_front();
+        w.hasInbox.store(!w.inbox.empty(), std::memory_order_relaxed);
+        return task;
+      }
+    }
+    return w.deque.pop();
+  }
+
+  Scheduler::Task* Scheduler::search(Worker& w) {
+    if(m_injectedSize.load(std::memory_order_relaxed)) {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if(!m_injected.empty()) {
+        Task* task = m_injected.front();
+        m_injected.pop_front();
+        m_injectedSize.fetch_sub(1, std::memory_order_relaxed);
+        return task;
+      }
+    }
+
+    size_t n = m_workers.size();
+    for(int round = 0; round < s_steal_rounds; ++round) {
+      size_t start = NextRand(w.rand) % n;
+      for(size_t i = 0; i < n; ++i) {
+        Worker& victim = *m_workers[(start + i) % n];
+        if(&victim == &w || victim.deque.empty()) {
+          continue;
+        }
+        if(Task* task = victim.deque.steal()) {
+          return task;
+        }
+      }
+    }
+    return nullptr;
+  }
+
+  bool Scheduler::hasWork(Worker& w) {
+    if(w.hasInbox.load(std::memory_order_relaxed)
+        || m_injectedSize.load(std::memory_order_relaxed)) {
+      return true;
+    }
+    for(auto& i : m_workers) {
+      if(!i->deque.empty()) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void Scheduler::run() {
+    setThis();
+    LOONGSERVER_ASSERT(t_worker >= 0);
+    Worker& w = *m_workers[t_worker];
+    w.threadId = GetThreadId();
+    w.rand = (uint64_t)w.threadId * 0x9E3779B97F4A7C15ULL | 1;
+    LogCrash::InstallAltStack();
+    if(!m_useCaller || t_worker != 0) {
+      t_scheduler_fiber = Fiber::GetThis().get();
+    }
+    LOONGSERVER_LOG_DEBUG(g_logger) << "Scheduler " << m_name << " worker " << t_worker << " run";
+
+    while(true) {
+      Task* task = take(w);
+      if(!task) {
+        m_searching.fetch_add(1, std::memory_order_seq_cst);
+        task = search(w);
+        //the last searcher to find work hands the search on to a parked worker
+        if(m_searching.fetch_sub(1, std::memory_order_seq_cst) == 1 && task) {
+          tickle();
+        }
+      }
+
+      if(task) {
+        execute(task);
+        continue;
+      }
+      if(stopping()) {
+        break;
+      }
+      idle();
+    }
+    LOONGSERVER_LOG_DEBUG(g_logger) << "Scheduler " << m_name << " worker " << t_worker << " exit";
+  }
+
+  void Scheduler::execute(Task* task) {
+    if(task->cb) {
+      task->fiber = FiberPool::Get(std::move(task->cb));
+      task->cb = nullptr;
+      task->pooled = true;
+    }
+
+    Fiber::spFIBER& fiber = task->fiber;
+    if(fiber->getState() != Fiber::TERM
+        && fiber->getState() != Fiber::EXCEPT) {
+      //the fiber may be running elsewhere once swapIn returns, use what it left with
+      Fiber::State state = fiber->swapIn();
+      if(state == Fiber::READY) {
+        //yielded: behind the work already queued, still counted in m_pending
+        Worker& w = *m_workers[t_worker];
+        if(task->thread >= 0) {
+          std::lock_guard<std::mutex> lock(w.inboxMutex);
+          w.inbox.push_back(task);
+          w.hasInbox.store(true, std::memory_order_relaxed);
+        }else {
+          {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_injected.push_back(task);
+            m_injectedSize.fetch_add(1, std::memory_order_relaxed);
+          }
+          tickle();
+        }
+        return;
+      }
+    }
+
+    if(task->pooled) {
+      FiberPool::Put(fiber);
+    }
+    delete task;
+
+    if(m_pending.fetch_sub(1, std::memory_order_acq_rel) == 1
+        && m_stopping.load(std::memory_order_acquire)) {
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      for(auto& i : m_workers) {
+        wake(*i);
+      }
+    }
+  }
+
+  void Scheduler::idle() {
+    Worker& w = *m_workers[t_worker];
+    uint32_t seq = w.parkSeq.load(std::memory_order_acquire);
+    m_parked.fetch_add(1, std::memory_order_relaxed);
+    w.parked.store(true, std::memory_order_relaxed);
+    //a push after this fence sees parked, a push before it is seen by hasWork
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(!hasWork(w) && !stopping()) {
+      FutexWait(w.parkSeq, seq);
+    }
+    w.parked.store(false, std::memory_order_relaxed);
+    m_parked.fetch_sub(1, std::memory_order_relaxed);
+  }
+
+  bool Scheduler::stopping() {
+    return m_stopping.load(std::memory_order_acquire)
+        && m_pending.load(std::memory_order_acquire) == 0;
+  }
+}
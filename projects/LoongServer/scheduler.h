@@ -0,0 +1,371 @@
+#ifndef __LOONGSERVER_SCHEDULER_H__
+#define __LOONGSERVER_SCHEDULER_H__
+
+#include <memory>
+#include <vector>
+#include <deque>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "noncopyable.h"
+#include "fiber.h"
+
+namespace loongserver {
+  /**
+   * @brief Chase-Lev work stealing deque of pointers
+   * @details the owner thread pushes and pops at the bottom, any thread may
+   *          steal from the top; the ring doubles when full and retired rings
+   *          are kept until destruction since a thief may still read them
+   */
+  template<class T>
+  class WorkStealingDeque : Noncopyable {
+  public:
+    WorkStealingDeque(size_t capacity = 256) {
+      m_ring.store(new Ring(capacity), std::memory_order_relaxed);
+    }
+
+    ~WorkStealingDeque() {
+      delete m_ring.load(std::memory_order_relaxed);
+      for(auto i : m_retired) {
+        delete i;
+      }
+    }
+
+    /**
+     * @brief add v at the bottom, owner only
+     */
+    void push(T* v) {
+      int64_t b = m_bottom.load(std::memory_order_relaxed);
+      int64_t t = m_top.load(std::memory_order_acquire);
+      Ring* ring = m_ring.load(std::memory_order_relaxed);
+      if(b - t >= ring->size) {
+        ring = grow(ring, t, b);
+      }
+      ring->put(b, v);
+      std::atomic_thread_fence(std::memory_order_release);
+      m_bottom.store(b + 1, std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief take from the bottom, owner only
+     * @return nullptr when empty
+     */
+    T* pop() {
+      int64_t b = m_bottom.load(std::memory_order_relaxed) - 1;
+      Ring* ring = m_ring.load(std::memory_order_relaxed);
+      m_bottom.store(b, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      int64_t t = m_top.load(std::memory_order_relaxed);
+      if(t > b) {
+        m_bottom.store(b + 1, std::memory_order_relaxed);
+        return nullptr;
+      }
+      T* v = ring->get(b);
+      if(t == b) {
+        //last element, race the thieves for it
+        if(!m_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst
+                                          ,std::memory_order_relaxed)) {
+          v = nullptr;
+        }
+        m_bottom.store(b + 1, std::memory_order_relaxed);
+      }
+      return v;
+    }
+
+    /**
+     * @brief take from the top, any thread
+     * @return nullptr when empty or another thread won the element
+     */
+    T* steal() {
+      int64_t t = m_top.load(std::memory_order_acquire);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      int64_t b = m_bottom.load(std::memory_order_acquire);
+      if(t >= b) {
+        return nullptr;
+      }
+      Ring* ring = m_ring.load(std::memory_order_acquire);
+      T* v = ring->get(t);
+      if(!m_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst
+                                        ,std::memory_order_relaxed)) {
+        return nullptr;
+      }
+      return v;
+    }
+
+    /**
+     * @brief return true if there is nothing to steal, any thread
+     */
+    bool empty() const {
+      int64_t b = m_bottom.load(std::memory_order_relaxed);
+      int64_t t = m_top.load(std::memory_order_relaxed);
+      return t >= b;
+    }
+
+  private:
+    struct Ring {
+      Ring(size_t capacity)
+        :size(capacity)
+        ,mask(capacity - 1)
+        ,buf(new std::atomic<T*>[capacity]) {
+      }
+
+      ~Ring() {
+        delete[] buf;
+      }
+
+      T* get(int64_t i) const {
+        return buf[i & mask].load(std::memory_order_relaxed);
+      }
+
+      void put(int64_t i, T* v) {
+        buf[i & mask].store(v, std::memory_order_relaxed);
+      }
+
+      int64_t          size;
+      int64_t          mask;
+      std::atomic<T*>* buf;
+    };
+
+    Ring* grow(Ring* ring, int64_t t, int64_t b) {
+      Ring* bigger = new Ring(ring->size * 2);
+      for(int64_t i = t; i < b; ++i) {
+        bigger->put(i, ring->get(i));
+      }
+      m_retired.push_back(ring);
+      m_ring.store(bigger, std::memory_order_release);
+      return bigger;
+    }
+
+  private:
+    //thieves hammer m_top, keep m_bottom of the owner on another cache line
+    std::atomic<int64_t> m_top {0};
+    char m_pad[64];
+    std::atomic<int64_t> m_bottom {0};
+    std::atomic<Ring*> m_ring;
+    std::vector<Ring*> m_retired;
+  };
+
+  /**
+   * @brief N:M fiber scheduler
+   * @details every worker owns a WorkStealingDeque, work scheduled by a
+   *          worker goes to its own deque and idle workers steal from random
+   *          victims; work scheduled from other threads goes through a shared
+   *          queue, work for one worker through its inbox. Workers with
+   *          nothing to do park on a futex and are woken one at a time.
+   *          Plain callbacks run on fibers drawn from FiberPool.
+   */
+  class Scheduler : Noncopyable {
+  public:
+    using spSCHEDULER = std::shared_ptr<Scheduler>;
+
+    /**
+     * @brief constructor
+     * @param[in] threads number of workers
+     * @param[in] use_caller the calling thread is one of the workers, it
+     *            runs scheduled work from within stop()
+     * @param[in] name name of the scheduler, workers are named name_N
+     */
+    Scheduler(size_t threads = 1, bool use_caller = true, const std::string& name = "");
+
+    /**
+     * @brief deconstructor
+     * @pre stop() was called
+     */
+    virtual ~Scheduler();
+
+    /**
+     * @brief return name of scheduler
+     */
+    const std::string& getName() const { return m_name;}
+
+    /**
+     * @brief pin worker N to the N-th cpu this process may run on
+     * @pre called before start(), the caller thread is never pinned
+     */
+    void setPinThreads(bool v) { m_pinThreads = v;}
+
+    /**
+     * @brief start worker threads
+     */
+    void start();
+
+    /**
+     * @brief wait until all scheduled work is done, then join workers
+     * @attention with use_caller it must be called from the caller thread
+     */
+    void stop();
+
+    /**
+     * @brief schedule a fiber or a callback
+     * @param[in] fc fiber or callback
+     * @param[in] thread index of the worker to run on, -1 for any
+     * @details a shared-stack fiber always runs on the worker which created it
+     */
+    template<class FiberOrCb>
+    void schedule(FiberOrCb fc, int thread = -1) {
+      push(new Task(std::move(fc), thread));
+    }
+
+    /**
+     * @brief schedule a batch of fibers or callbacks
+     */
+    template<class InputIterator>
+    void schedule(InputIterator begin, InputIterator end) {
+      while(begin != end) {
+        push(new Task(std::move(*begin), -1));
+        ++begin;
+      }
+    }
+
+  public:
+    /**
+     * @brief return scheduler of current thread
+     */
+    static Scheduler* GetThis();
+
+    /**
+     * @brief return the fiber scheduled fibers switch back to
+     */
+    static Fiber* GetMainFiber();
+
+    /**
+     * @brief return index of the worker running on current thread, -1 if none
+     */
+    static int GetWorkerIndex();
+
+  protected:
+    /**
+     * @brief wake a parked worker
+     * @param[in] thread the worker to wake, -1 for any one
+     */
+    virtual void tickle(int thread = -1);
+
+    /**
+     * @brief worker loop
+     */
+    void run();
+
+    /**
+     * @brief return true if the scheduler can stop
+     */
+    virtual bool stopping();
+
+    /**
+     * @brief wait until there is work or stopping() may have changed
+     */
+    virtual void idle();
+
+    /**
+     * @brief set the scheduler of current thread
+     */
+    void setThis();
+
+  private:
+    /**
+     * @brief a fiber or callback with the worker it must run on
+     */
+    struct Task {
+      Task(Fiber::spFIBER f, int thr)
+        :fiber(std::move(f))
+        ,thread(thr) {
+      }
+
+      Task(std::function<void()> f, int thr)
+        :cb(std::move(f))
+        ,thread(thr) {
+      }
+
+      Fiber::spFIBER        fiber;
+      std::function<void()> cb;
+      int                   thread;
+      /// @brief fiber was drawn from FiberPool for cb, goes back when done
+      bool                  pooled = false;
+    };
+
+    /**
+     * @brief state of one worker
+     */
+    struct Worker {
+      WorkStealingDeque<Task> deque;
+      /// @brief work that must run on this worker
+      std::mutex inboxMutex;
+      std::deque<Task*> inbox;
+      std::atomic<bool> hasInbox {false};
+      /// @brief futex word, bumped to wake the worker
+      std::atomic<uint32_t> parkSeq {0};
+      std::atomic<bool> parked {false};
+      /// @brief kernel thread id, 0 until the worker runs
+      std::atomic<pid_t> threadId {0};
+      /// @brief state of the victim picker
+      uint64_t rand = 0;
+      /// @brief tasks taken, every few the shared queue is looked at first
+      uint64_t tick = 0;
+    };
+
+    /**
+     * @brief queue task where its worker or a thief will find it
+     */
+    void push(Task* task);
+
+    /**
+     * @brief return next task for worker w, nullptr if none was found
+     */
+    Task* take(Worker& w);
+
+    /**
+     * @brief look for work outside the own deque and inbox
+     */
+    Task* search(Worker& w);
+
+    /**
+     * @brief run task on current worker
+     */
+    void execute(Task* task);
+
+    /**
+     * @brief return true if worker w would find something to run
+     */
+    bool hasWork(Worker& w);
+
+    /**
+     * @brief unpark w if it is parked
+     * @return true if w was parked
+     */
+    bool wake(Worker& w);
+
+    /**
+     * @brief return index of the worker with kernel thread id tid, -1 if none
+     */
+    int findWorker(pid_t tid) const;
+
+  private:
+    std::string m_name;
+    std::vector<std::unique_ptr<Worker>> m_workers;
+    std::vector<std::thread> m_threads;
+    /// @brief work scheduled from outside the workers
+    std::mutex m_mutex;
+    std::deque<Task*> m_injected;
+    std::atomic<size_t> m_injectedSize {0};
+    /// @brief scheduled tasks not yet finished, queued or running
+    std::atomic<int64_t> m_pending {0};
+    /// @brief workers looking for work to steal
+    std::atomic<int32_t> m_searching {0};
+    /// @brief workers parked or about to park
+    std::atomic<int32_t> m_parked {0};
+    /// @brief use_caller: the fiber running run() on the caller thread
+    Fiber::spFIBER m_rootFiber;
+    /// @brief use_caller: worker threads to create besides the caller
+    size_t m_threadCount = 0;
+    bool m_useCaller = false;
+    bool m_pinThreads = false;
+    bool m_started = false;
+    std::atomic<bool> m_stopping {false};
+  };
+}
+
+#endif
@@ -0,0 +1,64 @@
+#include "thread.h"
+
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <iostream>
+
+namespace loongserver {
+  static const std::string s_unknown_name = "UNKNOW";
+
+  //names are never freed, readers index without taking the lock
+  static std::atomic<const std::string*> s_names[Thread::MAX_NAMES];
+  static std::atomic<uint32_t> s_name_count {1};
+  static std::mutex s_name_mutex;
+
+  static thread_local uint32_t t_name_id = Thread::UNKNOWN_NAME_ID;
+
+  static std::map<std::string, uint32_t>& GetNameIds() {
+    static std::map<std::string, uint32_t> s_ids;
+    return s_ids;
+  }
+
+  static uint32_t InternName(const std::string& name) {
+    std::lock_guard<std::mutex> lock(s_name_mutex);
+    auto& ids = GetNameIds();
+    auto it = ids.find(name);
+    if(it != ids.end()) {
+      return it->second;
+    }
+    uint32_t id = s_name_count.load(std::memory_order_relaxed);
+    if(id >= Thread::MAX_NAMES) {
+      std::cout << "Thread name table full, name=" << name << " logged as "
+                << s_unknown_name << std::endl;
+      return Thread::UNKNOWN_NAME_ID;
+    }
+    s_names[id].store(new std::string(name), std::memory_order_release);
+    s_name_count.store(id + 1, std::memory_order_release);
+    ids[name] = id;
+    return id;
+  }
+
+  void Thread::SetName(const std::string& name) {
+    if(name.empty()) {
+      return;
+    }
+    t_name_id = (name == s_unknown_name ? UNKNOWN_NAME_ID : InternName(name));
+  }
+
+  const std::string& Thread::GetName() {
+    return GetNameById(t_name_id);
+  }
+
+  uint32_t Thread::GetNameId() {
+    return t_name_id;
+  }
+
+  const std::string& Thread::GetNameById(uint32_t id) {
+    if(id == UNKNOWN_NAME_ID || id >= MAX_NAMES) {
+      return s_unknown_name;
+    }
+    const std::string* name = s_names[id].load(std::memory_order_acquire);
+    return name ? *name : s_unknown_name;
+  }
+}
@@ -1,3 +1,44 @@
+#ifndef __LOONGSERVER_THREAD_H__
+#define __LOONGSERVER_THREAD_H__
 
+#include "mutex.h"
 
-#include "mutex.h"
\ No newline at end of file
+#include <string>
+#include <stdint.h>
+
+namespace loongserver {
+  /**
+   * @brief thread identity
+   * @details names are interned, a thread only carries the id of its name
+   *          and the string is looked up when it is printed
+   */
+  class Thread : Noncopyable {
+  public:
+    /// @brief id of the default name "UNKNOW"
+    static const uint32_t UNKNOWN_NAME_ID = 0;
+    /// @brief distinct names that can be interned, later names fall back to UNKNOW
+    static const uint32_t MAX_NAMES = 4096;
+
+    /**
+     * @brief set name of current thread
+     */
+    static void SetName(const std::string& name);
+
+    /**
+     * @brief return name of current thread
+     */
+    static const std::string& GetName();
+
+    /**
+     * @brief return interned name id of current thread
+     */
+    static uint32_t GetNameId();
+
+    /**
+     * @brief return name of an interned id, lock free
+     */
+    static const std::string& GetNameById(uint32_t id);
+  };
+}
+
+#endif
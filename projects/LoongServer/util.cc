@@ -0,0 +1,280 @@
+#include "util.h"
+#include "fiber.h"
+
+#include <atomic>
+#include <mutex>
+#include <algorithm>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <execinfo.h>
+#include <cxxabi.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sstream>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+
+namespace loongserver {
+  static thread_local pid_t t_thread_id = 0;
+
+  //the child of fork inherits the cached id of the forking thread
+  static int s_thread_id_atfork = pthread_atfork(nullptr, nullptr, [](){ t_thread_id = 0; });
+
+  pid_t GetThreadId() {
+    if(!t_thread_id) {
+      t_thread_id = syscall(SYS_gettid);
+    }
+    return t_thread_id;
+  }
+
+  uint64_t GetFiberId() {
+    return Fiber::GetFiberId();
+  }
+
+  uint64_t GetCurrentMS() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000ul + tv.tv_usec / 1000;
+  }
+
+  uint64_t GetCurrentUS() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000 * 1000ul + tv.tv_usec;
+  }
+
+  static uint64_t ReadMonotonicRaw() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+  }
+
+  static uint64_t ReadWallRaw() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+  }
+
+  static bool HasInvariantTsc() {
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned int eax, ebx, ecx, edx;
+    if(!__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) || eax < 0x80000007) {
+      return false;
+    }
+    __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+    return edx & (1u << 8);
+#else
+    return false;
+#endif
+  }
+
+  //the lfence keeps later loads, the clock seqlock among them, behind the read
+  static uint64_t ReadTsc() {
+#if defined(__x86_64__) || defined(__i386__)
+    uint64_t tsc = __rdtsc();
+    _mm_lfence();
+    return tsc;
+#else
+    return 0;
+#endif
+  }
+
+  //rdtsc after every earlier load and store has completed
+  static uint64_t ReadTscOrdered() {
+#if defined(__x86_64__) || defined(__i386__)
+    _mm_mfence();
+    _mm_lfence();
+    return ReadTsc();
+#else
+    return 0;
+#endif
+  }
+
+  //re-anchor the TSC scale and the wall clock after this much monotonic time
+  static const uint64_t s_clock_recalibrate_ns = 1000ull * 1000 * 1000;
+
+  /**
+   * @brief anchors of the clock service, written under a seqlock
+   * @details ns = base_ns + ((tsc - base_tsc) * mult >> 32), ns counts from
+   *          process start; wall_ns is wall clock minus that ns at the last
+   *          recalibration
+   */
+  struct ClockData {
+    ClockData();
+    void recalibrate(uint64_t tsc);
+    void refreshWall(uint64_t now);
+
+    bool                  use_tsc;
+    uint64_t              start_tsc;
+    uint64_t              start_mono;
+    std::atomic<uint32_t> seq {0};
+    std::atomic<uint64_t> base_tsc {0};
+    std::atomic<uint64_t> base_ns {0};
+    std::atomic<uint64_t> mult {0};
+    std::atomic<uint64_t> next_tsc {0};
+    std::atomic<uint64_t> wall_ns {0};
+    std::atomic<uint64_t> next_wall_ns {0};
+    std::mutex            mutex;
+  };
+
+  ClockData::ClockData() {
+    use_tsc = HasInvariantTsc();
+    start_mono = ReadMonotonicRaw();
+    start_tsc = ReadTsc();
+    wall_ns = ReadWallRaw();
+    next_wall_ns = s_clock_recalibrate_ns;
+    if(!use_tsc) {
+      return;
+    }
+    //short first estimate, refined against a growing baseline later
+    uint64_t mono;
+    uint64_t tsc;
+    do {
+      mono = ReadMonotonicRaw();
+      tsc = ReadTsc();
+    } while(mono - start_mono < 2 * 1000 * 1000);
+    if(tsc <= start_tsc) {
+      use_tsc = false;
+      return;
+    }
+    mult = (uint64_t)(((unsigned __int128)(mono - start_mono) << 32) / (tsc - start_tsc));
+    base_tsc = tsc;
+    base_ns = mono - start_mono;
+    next_tsc = tsc + (tsc - start_tsc) * 50;
+  }
+
+  void ClockData::recalibrate(uint64_t tsc) {
+    std::unique_lock<std::mutex> lock(mutex, std::try_to_lock);
+    if(!lock || tsc < next_tsc.load(std::memory_order_relaxed)) {
+      return;
+    }
+    seq.fetch_add(1, std::memory_order_acq_rel);
+    //readers that got past seq read their tsc before this one, so the old
+    //curve gave them at most now; the new curve starts there and readers with
+    //an older tsc get now as well, the clock never steps back
+    tsc = ReadTscOrdered();
+    uint64_t old_tsc = base_tsc.load(std::memory_order_relaxed);
+    uint64_t now = base_ns.load(std::memory_order_relaxed);
+    if(tsc > old_tsc) {
+      now += (uint64_t)(((unsigned __int128)(tsc - old_tsc)
+                         * mult.load(std::memory_order_relaxed)) >> 32);
+    }
+    uint64_t mono = ReadMonotonicRaw() - start_mono;
+    //rate over the whole process lifetime, slewed so the estimate meets
+    //CLOCK_MONOTONIC again one period from now
+    const int64_t period = s_clock_recalibrate_ns;
+    unsigned __int128 rate = ((unsigned __int128)mono << 32) / (tsc - start_tsc);
+    int64_t error = std::max(-period / 2, std::min(period / 2, (int64_t)(mono - now)));
+    uint64_t m = (uint64_t)(rate * (uint64_t)(period + error) / (uint64_t)period);
+    uint64_t period_ticks = (uint64_t)(((unsigned __int128)period << 32) / m);
+
+    base_tsc.store(tsc, std::memory_order_relaxed);
+    base_ns.store(now, std::memory_order_relaxed);
+    mult.store(m, std::memory_order_relaxed);
+    next_tsc.store(tsc + period_ticks, std::memory_order_relaxed);
+    seq.fetch_add(1, std::memory_order_release);
+
+    wall_ns.store(ReadWallRaw() - now, std::memory_order_relaxed);
+  }
+
+  void ClockData::refreshWall(uint64_t now) {
+    std::unique_lock<std::mutex> lock(mutex, std::try_to_lock);
+    if(!lock || now < next_wall_ns.load(std::memory_order_relaxed)) {
+      return;
+    }
+    wall_ns.store(ReadWallRaw() - now, std::memory_order_relaxed);
+    next_wall_ns.store(now + s_clock_recalibrate_ns, std::memory_order_relaxed);
+  }
+
+  static ClockData& GetClockData() {
+    static ClockData s_data;
+    return s_data;
+  }
+
+  //start the clock with the process rather than on the first log
+  static ClockData& s_clock_data = GetClockData();
+
+  uint64_t GetMonotonicNS() {
+    ClockData& data = GetClockData();
+    if(!data.use_tsc) {
+      return ReadMonotonicRaw() - data.start_mono;
+    }
+    uint64_t tsc = ReadTsc();
+    uint64_t ns;
+    uint32_t seq;
+    do {
+      seq = data.seq.load(std::memory_order_acquire);
+      uint64_t base_tsc = data.base_tsc.load(std::memory_order_relaxed);
+      uint64_t mult = data.mult.load(std::memory_order_relaxed);
+      ns = data.base_ns.load(std::memory_order_relaxed);
+      //another core may have read a slightly older tsc than the latest base
+      if(tsc > base_tsc) {
+        ns += (uint64_t)(((unsigned __int128)(tsc - base_tsc) * mult) >> 32);
+      }
+      std::atomic_thread_fence(std::memory_order_acquire);
+    } while((seq & 1) || seq != data.seq.load(std::memory_order_relaxed));
+
+    if(tsc >= data.next_tsc.load(std::memory_order_relaxed)) {
+      data.recalibrate(tsc);
+    }
+    return ns;
+  }
+
+  uint64_t GetCoarseCurrentUS() {
+    ClockData& data = GetClockData();
+    uint64_t now = GetMonotonicNS();
+    if(!data.use_tsc && now >= data.next_wall_ns.load(std::memory_order_relaxed)) {
+      data.refreshWall(now);
+    }
+    return (data.wall_ns.load(std::memory_order_relaxed) + now) / 1000;
+  }
+
+  /**
+   * @brief demangle the symbol of a backtrace_symbols line
+   * @details the line looks like "binary(_ZN4name+0x12) [0x...]"
+   */
+  static std::string Demangle(const char* str) {
+    const char* begin = strchr(str, '(');
+    const char* end = begin ? strchr(begin, '+') : nullptr;
+    if(!begin || !end || end == begin + 1) {
+      return str;
+    }
+    std::string symbol(begin + 1, end);
+    int status = 0;
+    char* name = abi::__cxa_demangle(symbol.c_str(), nullptr, nullptr, &status);
+    if(status != 0 || !name) {
+      return str;
+    }
+    std::string rt = std::string(str, begin + 1) + name + end;
+    free(name);
+    return rt;
+  }
+
+  void Backtrace(std::vector<std::string>& bt, int size, int skip) {
+    std::vector<void*> frames(size);
+    int n = backtrace(frames.data(), size);
+    char** strings = backtrace_symbols(frames.data(), n);
+    if(!strings) {
+      return;
+    }
+    for(int i = skip; i < n; ++i) {
+      bt.push_back(Demangle(strings[i]));
+    }
+    free(strings);
+  }
+
+  std::string BacktraceToString(int size, int skip, const std::string& prefix) {
+    std::vector<std::string> bt;
+    Backtrace(bt, size, skip);
+    std::stringstream ss;
+    for(auto& i : bt) {
+      ss << prefix << i << std::endl;
+    }
+    return ss.str();
+  }
+}
@@ -0,0 +1,58 @@
+#ifndef __LOONGSERVER_UTIL_H__
+#define __LOONGSERVER_UTIL_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <string>
+#include <vector>
+
+namespace loongserver {
+  /**
+   * @brief return kernel thread id, cached per thread after the first call
+   */
+  pid_t GetThreadId();
+
+  /**
+   * @brief return id of the running fiber, 0 outside fibers
+   */
+  uint64_t GetFiberId();
+
+  /**
+   * @brief return wall clock in milliseconds
+   */
+  uint64_t GetCurrentMS();
+
+  /**
+   * @brief return wall clock in microseconds
+   */
+  uint64_t GetCurrentUS();
+
+  /**
+   * @brief return monotonic nanoseconds since process start
+   * @details read from the invariant TSC when the cpu has one, scaled by a
+   *          rate recalibrated against CLOCK_MONOTONIC about once a second,
+   *          otherwise clock_gettime(CLOCK_MONOTONIC); never goes backwards
+   */
+  uint64_t GetMonotonicNS();
+
+  /**
+   * @brief return wall clock in microseconds derived from GetMonotonicNS
+   * @details no syscall, follows wall clock steps at the next recalibration
+   */
+  uint64_t GetCoarseCurrentUS();
+
+  /**
+   * @brief get call stack of the calling thread, demangled
+   * @param[out] bt one entry per frame, innermost first
+   * @param[in] size max number of frames
+   * @param[in] skip frames dropped from the top
+   */
+  void Backtrace(std::vector<std::string>& bt, int size = 64, int skip = 1);
+
+  /**
+   * @brief return call stack of the calling thread, one frame per line
+   */
+  std::string BacktraceToString(int size = 64, int skip = 2, const std::string& prefix = "");
+}
+
+#endif